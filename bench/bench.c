@@ -0,0 +1,754 @@
+// bench.c
+// Benchmark driver for jobthing
+//
+// Usage: ./bench [-j jobthing] [-w workload] [-n workers] [-l lines]
+//     [-r rate] [-s size] [-t timeout] [-i] [-o option=value ...]
+//
+// Generates a jobfile of N workers of the given kind, feeds jobthing lines
+// carrying a send timestamp (through stdin, or through -i and a FIFO) and
+// prints one line of key=value results so that runs from different commits
+// can be compared with a plain diff
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define READ_END 0
+#define WRITE_END 1
+#define MAX_OPTIONS 16
+#define OUTPUT_BUFFER_SIZE 65536
+#define INPUT_BATCH 256
+#define MAX_PAYLOAD 4096
+#define RSS_SAMPLE_US 50000
+#define DEFAULT_WORKERS 4
+#define DEFAULT_LINES 100000
+#define DEFAULT_SIZE 32
+#define DEFAULT_TIMEOUT_S 120
+
+/*
+* Struct Definitions
+*/
+
+/* BenchArgs Struct
+* -----------------------------------------------
+* jobthing: path of the jobthing binary
+* workload: the kind of worker (cat, echo, crash, slow or mix)
+* workers: the number of workers in the generated jobfile
+* lines: the number of input lines to send
+* rate: input lines per second (0 to send as fast as jobthing reads)
+* size: the length of every input line, padding included
+* timeoutS: seconds after which jobthing is killed
+* fileInput: true to pass the input through -i rather than stdin
+* options: -o arguments passed on to jobthing
+*/
+typedef struct {
+    const char *jobthing;
+    const char *workload;
+    int workers;
+    long lines;
+    long rate;
+    int size;
+    int timeoutS;
+    bool fileInput;
+    const char *options[MAX_OPTIONS];
+    int optionCount;
+} BenchArgs;
+
+/* Samples Struct
+* -----------------------------------------------
+* Growable list of end-to-end latencies in microseconds
+*/
+typedef struct {
+    uint32_t *data;
+    size_t count, cap;
+} Samples;
+
+/* BenchRun Struct
+* -----------------------------------------------
+* pid: the jobthing process
+* inFd: the write end of jobthing's input (stdin pipe or FIFO), -1 once closed
+* outFd: the read end of jobthing's stdout, -1 once closed
+* sent: the number of input lines sent so far
+* pending, pendingLen, pendingOff: a batch of lines not fully written yet
+* outBuf, outLen: stdout data not yet split into lines
+* linesOut: the number of lines jobthing received from its workers
+* respawns: worker exits with a failure status or a signal
+* latency: end-to-end latencies of lines carrying a timestamp
+* startUs, endUs: when the run started and when jobthing's stdout closed
+* rssKb: jobthing's peak resident set size
+*/
+typedef struct {
+    pid_t pid;
+    int inFd, outFd;
+    long sent;
+    char *pending;
+    size_t pendingLen, pendingOff;
+    char outBuf[OUTPUT_BUFFER_SIZE];
+    size_t outLen;
+    long linesOut;
+    long respawns;
+    Samples latency;
+    uint64_t startUs, endUs;
+    long rssKb;
+} BenchRun;
+
+/*
+* Function Prototypes
+*/
+BenchArgs parse_args(int argc, char *argv[]);
+void usage_error(void);
+uint64_t now_us(void);
+bool write_jobfile(const BenchArgs *args, const char *path);
+const char *worker_spec(const char *workload, int index);
+bool write_input_file(const BenchArgs *args, const char *path);
+size_t format_line(const BenchArgs *args, long seq, uint64_t sentUs,
+        char *buf);
+pid_t launch(const BenchArgs *args, const char *jobfile, const char *input,
+        BenchRun *run);
+void drive(const BenchArgs *args, BenchRun *run);
+void fill_pending(const BenchArgs *args, BenchRun *run, long due);
+void flush_pending(BenchRun *run);
+void close_input(BenchRun *run);
+void read_output(BenchRun *run);
+void handle_output_line(BenchRun *run, char *line, size_t len);
+void samples_add(Samples *samples, uint32_t value);
+uint32_t samples_percentile(Samples *samples, double fraction);
+int compare_samples(const void *a, const void *b);
+void sample_rss(BenchRun *run);
+long supervisor_cpu_ms(pid_t pid);
+void report(const BenchArgs *args, BenchRun *run, long cpuMs, int status);
+
+/* int main(int argc, char *argv[])
+* -----------------------------------------------
+* Main function for the benchmark driver
+*
+* args: int argc, char *argv[]
+* Returns: 0 if jobthing ran to completion, 1 otherwise
+* Errors: exits with code 2 on a usage error
+*/
+int main(int argc, char *argv[]) {
+    BenchArgs args = parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    char dir[] = "/tmp/jobthing-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char jobfile[sizeof(dir) + 16], input[sizeof(dir) + 16];
+    snprintf(jobfile, sizeof(jobfile), "%s/jobfile", dir);
+    snprintf(input, sizeof(input), "%s/input", dir);
+    if (!write_jobfile(&args, jobfile)) {
+        perror(jobfile);
+        return 1;
+    }
+    // Rate limited file input goes through a FIFO so that lines still carry
+    // the time they were handed over; otherwise the file is written up front
+    bool fifo = args.fileInput && args.rate > 0;
+    if ((fifo && mkfifo(input, 0600) == -1)
+            || (args.fileInput && !fifo
+            && !write_input_file(&args, input))) {
+        perror(input);
+        return 1;
+    }
+
+    BenchRun *run = calloc(1, sizeof(BenchRun));
+    if (launch(&args, jobfile, args.fileInput ? input : NULL, run) == -1) {
+        perror(args.jobthing);
+        return 1;
+    }
+    drive(&args, run);
+
+    // Read the CPU time while jobthing is a zombie, before its own time is
+    // folded into ours and while its workers' time is still kept apart
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    waitid(P_PID, run->pid, &info, WEXITED | WNOWAIT);
+    long cpuMs = supervisor_cpu_ms(run->pid);
+    int status;
+    waitpid(run->pid, &status, 0);
+    report(&args, run, cpuMs, status);
+
+    unlink(jobfile);
+    unlink(input);
+    rmdir(dir);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
+
+/* BenchArgs parse_args(int argc, char *argv[])
+* -----------------------------------------------
+* Parses the command line of the driver
+*
+* args: int argc, char *argv[]
+* Returns: the parsed arguments
+* Errors: exits with code 2 on an invalid command line
+*/
+BenchArgs parse_args(int argc, char *argv[]) {
+    BenchArgs args;
+    memset(&args, 0, sizeof(args));
+    args.jobthing = "./jobthing";
+    args.workload = "cat";
+    args.workers = DEFAULT_WORKERS;
+    args.lines = DEFAULT_LINES;
+    args.size = DEFAULT_SIZE;
+    args.timeoutS = DEFAULT_TIMEOUT_S;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:w:n:l:r:s:t:io:")) != -1) {
+        switch (opt) {
+            case 'j':
+                args.jobthing = optarg;
+                break;
+            case 'w':
+                args.workload = optarg;
+                break;
+            case 'n':
+                args.workers = atoi(optarg);
+                break;
+            case 'l':
+                args.lines = atol(optarg);
+                break;
+            case 'r':
+                args.rate = atol(optarg);
+                break;
+            case 's':
+                args.size = atoi(optarg);
+                break;
+            case 't':
+                args.timeoutS = atoi(optarg);
+                break;
+            case 'i':
+                args.fileInput = true;
+                break;
+            case 'o':
+                if (args.optionCount == MAX_OPTIONS) {
+                    usage_error();
+                }
+                args.options[args.optionCount++] = optarg;
+                break;
+            default:
+                usage_error();
+        }
+    }
+    if (optind != argc || args.workers < 1 || args.lines < 1
+            || args.rate < 0 || args.size < 1 || args.size > MAX_PAYLOAD
+            || args.timeoutS < 1
+            || worker_spec(args.workload, 0) == NULL) {
+        usage_error();
+    }
+    return args;
+}
+
+/* void usage_error(void)
+* -----------------------------------------------
+* Prints the usage message of the driver
+*
+* Errors: exits with code 2
+*/
+void usage_error(void) {
+    fprintf(stderr, "Usage: bench [-j jobthing] [-w cat|echo|crash|slow|mix] "
+            "[-n workers] [-l lines] [-r rate] [-s size] [-t timeout] [-i] "
+            "[-o option=value ...]\n");
+    exit(2);
+}
+
+/* uint64_t now_us(void)
+* -----------------------------------------------
+* Reads the monotonic clock
+*
+* Returns: the current time in microseconds
+*/
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* const char *worker_spec(const char *workload, int index)
+* -----------------------------------------------
+* Gives the jobfile line of one worker. Every worker reads the main input and
+* writes its output back to jobthing so that latency can be measured:
+* cat: copies its input
+* echo: a shell loop echoing one line at a time
+* crash: copies 50 lines and exits with status 1 (run with -o backoff=0
+*     -o crashloop=0 to measure respawns rather than backoff)
+* slow: a shell loop that sleeps 10ms before echoing each line
+* mix: the four kinds above in turn
+*
+* args: workload - the kind of worker, index - the position of the worker
+* Returns: the jobfile line, or NULL if the workload is unknown
+*/
+const char *worker_spec(const char *workload, int index) {
+    static const char *const specs[] = {
+        "0:::cat",
+        "0:::sh -c \"while IFS= read -r l; do echo $l; done\"",
+        "0:::sh -c \"head -n 50; exit 1\"",
+        "0:::sh -c \"while IFS= read -r l; do sleep 0.01; echo $l; done\"",
+    };
+    static const char *const names[] = {"cat", "echo", "crash", "slow"};
+    if (strcmp(workload, "mix") == 0) {
+        return specs[index % 4];
+    }
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(workload, names[i]) == 0) {
+            return specs[i];
+        }
+    }
+    return NULL;
+}
+
+/* bool write_jobfile(const BenchArgs *args, const char *path)
+* -----------------------------------------------
+* Generates the jobfile for a run
+*
+* args: args - the driver arguments, path - where the jobfile is written
+* Returns: true on success
+*/
+bool write_jobfile(const BenchArgs *args, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "# %d %s workers\n", args->workers, args->workload);
+    for (int i = 0; i < args->workers; i++) {
+        fprintf(file, "%s\n", worker_spec(args->workload, i));
+    }
+    return fclose(file) == 0;
+}
+
+/* size_t format_line(const BenchArgs *args, long seq, uint64_t sentUs,
+        char *buf)
+* -----------------------------------------------
+* Formats one input line: a sequence number, the send time relative to the
+* start of the run (0 if unknown) and padding up to the requested size
+*
+* args: args - the driver arguments, seq - the line number, sentUs - the send
+*     time, buf - where the line is written (at least MAX_PAYLOAD + 64 bytes)
+* Returns: the length of the line, newline included
+*/
+size_t format_line(const BenchArgs *args, long seq, uint64_t sentUs,
+        char *buf) {
+    int len = sprintf(buf, "%ld %llu ", seq, (unsigned long long) sentUs);
+    while (len < args->size - 1) {
+        buf[len++] = 'x';
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+/* bool write_input_file(const BenchArgs *args, const char *path)
+* -----------------------------------------------
+* Writes every input line to a regular file for an unthrottled -i run. The
+* lines carry no timestamp, so such runs only report throughput
+*
+* args: args - the driver arguments, path - where the input is written
+* Returns: true on success
+*/
+bool write_input_file(const BenchArgs *args, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    char line[MAX_PAYLOAD + 64];
+    for (long seq = 0; seq < args->lines; seq++) {
+        fwrite(line, 1, format_line(args, seq, 0, line), file);
+    }
+    return fclose(file) == 0;
+}
+
+/* pid_t launch(const BenchArgs *args, const char *jobfile,
+        const char *input, BenchRun *run)
+* -----------------------------------------------
+* Starts jobthing with its stdout on a pipe and its input on a pipe, the given
+* file or FIFO
+*
+* args: args - the driver arguments, jobfile - the generated jobfile,
+*     input - the -i path or NULL for stdin, run - the run state to set up
+* Returns: the process ID of jobthing, or -1 on failure
+*/
+pid_t launch(const BenchArgs *args, const char *jobfile, const char *input,
+        BenchRun *run) {
+    int inPipe[2] = {-1, -1}, outPipe[2];
+    if ((input == NULL && pipe(inPipe) == -1) || pipe(outPipe) == -1) {
+        return -1;
+    }
+    const char *argv[2 * MAX_OPTIONS + 6];
+    int argc = 0;
+    argv[argc++] = args->jobthing;
+    for (int i = 0; i < args->optionCount; i++) {
+        argv[argc++] = "-o";
+        argv[argc++] = args->options[i];
+    }
+    if (input != NULL) {
+        argv[argc++] = "-i";
+        argv[argc++] = input;
+    }
+    argv[argc++] = jobfile;
+    argv[argc] = NULL;
+
+    run->startUs = now_us();
+    run->pid = fork();
+    if (run->pid == 0) {
+        if (input == NULL) {
+            dup2(inPipe[READ_END], STDIN_FILENO);
+            close(inPipe[READ_END]);
+            close(inPipe[WRITE_END]);
+        } else {
+            int devNull = open("/dev/null", O_RDONLY);
+            dup2(devNull, STDIN_FILENO);
+            close(devNull);
+        }
+        dup2(outPipe[WRITE_END], STDOUT_FILENO);
+        close(outPipe[READ_END]);
+        close(outPipe[WRITE_END]);
+        execvp(argv[0], (char *const *) argv);
+        _exit(99);
+    }
+    close(outPipe[WRITE_END]);
+    run->outFd = outPipe[READ_END];
+    run->inFd = -1;
+    if (input == NULL) {
+        close(inPipe[READ_END]);
+        run->inFd = inPipe[WRITE_END];
+    } else if (args->rate > 0) {
+        // Blocks until jobthing opens the FIFO for reading
+        run->inFd = open(input, O_WRONLY);
+    }
+    if (run->inFd >= 0) {
+        fcntl(run->inFd, F_SETFL, fcntl(run->inFd, F_GETFL) | O_NONBLOCK);
+    }
+    run->pending = malloc(INPUT_BATCH * (MAX_PAYLOAD + 64));
+    if (run->inFd == -1) {
+        run->sent = args->lines;
+    }
+    return run->pid;
+}
+
+/* void drive(const BenchArgs *args, BenchRun *run)
+* -----------------------------------------------
+* Sends the input at the requested rate while collecting jobthing's output,
+* until jobthing closes its stdout or the timeout expires
+*
+* args: args - the driver arguments, run - the run state
+*/
+void drive(const BenchArgs *args, BenchRun *run) {
+    uint64_t deadline = run->startUs + (uint64_t) args->timeoutS * 1000000;
+    uint64_t lastRss = 0;
+    while (run->outFd >= 0) {
+        uint64_t now = now_us();
+        if (now >= deadline) {
+            fprintf(stderr, "bench: timed out, killing jobthing\n");
+            kill(run->pid, SIGKILL);
+            close_input(run);
+            close(run->outFd);
+            run->outFd = -1;
+            break;
+        }
+        if (now - lastRss >= RSS_SAMPLE_US) {
+            sample_rss(run);
+            lastRss = now;
+        }
+        int timeout = 100;
+        if (run->inFd >= 0) {
+            long due = args->lines;
+            if (args->rate > 0) {
+                due = (long) ((now - run->startUs) * args->rate / 1000000);
+                if (due > args->lines) {
+                    due = args->lines;
+                }
+            }
+            fill_pending(args, run, due);
+            flush_pending(run);
+            if (run->pendingOff == run->pendingLen
+                    && run->sent == args->lines) {
+                sample_rss(run);
+                close_input(run);
+            } else if (run->pendingOff == run->pendingLen) {
+                // Sleep until the next line is due
+                timeout = 1;
+            }
+        }
+        struct pollfd fds[2];
+        int count = 0;
+        fds[count].fd = run->outFd;
+        fds[count++].events = POLLIN;
+        if (run->inFd >= 0 && run->pendingOff < run->pendingLen) {
+            fds[count].fd = run->inFd;
+            fds[count++].events = POLLOUT;
+        }
+        if (poll(fds, count, timeout) > 0 && fds[0].revents) {
+            read_output(run);
+        }
+    }
+    run->endUs = now_us();
+}
+
+/* void fill_pending(const BenchArgs *args, BenchRun *run, long due)
+* -----------------------------------------------
+* Formats the next batch of due lines once the previous batch has been
+* written, stamping them with the current time
+*
+* args: args - the driver arguments, run - the run state, due - the number
+*     of lines that should have been sent by now
+*/
+void fill_pending(const BenchArgs *args, BenchRun *run, long due) {
+    if (run->pendingOff < run->pendingLen || run->sent >= due) {
+        return;
+    }
+    uint64_t sentUs = now_us() - run->startUs;
+    if (sentUs == 0) {
+        sentUs = 1;
+    }
+    run->pendingLen = run->pendingOff = 0;
+    for (int i = 0; i < INPUT_BATCH && run->sent < due; i++) {
+        run->pendingLen += format_line(args, run->sent++, sentUs,
+                run->pending + run->pendingLen);
+    }
+}
+
+/* void flush_pending(BenchRun *run)
+* -----------------------------------------------
+* Writes as much of the pending batch as jobthing's input will take
+*
+* args: run - the run state
+*/
+void flush_pending(BenchRun *run) {
+    while (run->pendingOff < run->pendingLen) {
+        ssize_t written = write(run->inFd, run->pending + run->pendingOff,
+                run->pendingLen - run->pendingOff);
+        if (written > 0) {
+            run->pendingOff += written;
+        } else if (written == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (written == -1 && errno != EAGAIN) {
+                // jobthing stopped reading; nothing more can be sent
+                run->pendingOff = run->pendingLen;
+                close_input(run);
+            }
+            return;
+        }
+    }
+}
+
+/* void close_input(BenchRun *run)
+* -----------------------------------------------
+* Signals the end of the input to jobthing
+*
+* args: run - the run state
+*/
+void close_input(BenchRun *run) {
+    if (run->inFd >= 0) {
+        close(run->inFd);
+        run->inFd = -1;
+    }
+}
+
+/* void read_output(BenchRun *run)
+* -----------------------------------------------
+* Reads what jobthing has written to its stdout and handles every complete
+* line
+*
+* args: run - the run state
+*/
+void read_output(BenchRun *run) {
+    ssize_t got = read(run->outFd, run->outBuf + run->outLen,
+            sizeof(run->outBuf) - run->outLen);
+    if (got == -1 && errno == EINTR) {
+        return;
+    }
+    if (got <= 0) {
+        close(run->outFd);
+        run->outFd = -1;
+        return;
+    }
+    run->outLen += got;
+    char *start = run->outBuf;
+    char *end = run->outBuf + run->outLen;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        handle_output_line(run, start, newline - start);
+        start = newline + 1;
+    }
+    run->outLen = end - start;
+    if (run->outLen == sizeof(run->outBuf)) {
+        // A line longer than the buffer cannot be one of ours
+        run->outLen = 0;
+    } else {
+        memmove(run->outBuf, start, run->outLen);
+    }
+}
+
+/* void handle_output_line(BenchRun *run, char *line, size_t len)
+* -----------------------------------------------
+* Accounts for one line of jobthing's output: lines relayed from a worker
+* ("N->'...'") give a latency sample and failed exits count as respawns;
+* clean exits are the workers reaching the end of their input
+*
+* args: run - the run state, line - the NUL terminated line, len - its length
+*/
+void handle_output_line(BenchRun *run, char *line, size_t len) {
+    char *payload = strstr(line, "->'");
+    if (payload != NULL) {
+        run->linesOut++;
+        char *end;
+        strtol(payload + 3, &end, 10);
+        uint64_t sentUs = strtoull(end, NULL, 10);
+        if (sentUs != 0) {
+            uint64_t latency = now_us() - run->startUs - sentUs;
+            samples_add(&run->latency,
+                    latency > UINT32_MAX ? UINT32_MAX : latency);
+        }
+    } else if (strncmp(line, "Job ", 4) == 0
+            && strstr(line, " has terminated ") != NULL
+            && strstr(line, " exit code 0") == NULL) {
+        run->respawns++;
+    }
+    (void) len;
+}
+
+/* void samples_add(Samples *samples, uint32_t value)
+* -----------------------------------------------
+* Appends a latency sample
+*
+* args: samples - the list, value - the latency in microseconds
+*/
+void samples_add(Samples *samples, uint32_t value) {
+    if (samples->count == samples->cap) {
+        samples->cap = samples->cap ? samples->cap * 2 : 4096;
+        samples->data = realloc(samples->data,
+                samples->cap * sizeof(uint32_t));
+    }
+    samples->data[samples->count++] = value;
+}
+
+/* int compare_samples(const void *a, const void *b)
+* -----------------------------------------------
+* qsort comparator for latency samples
+*/
+int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* uint32_t samples_percentile(Samples *samples, double fraction)
+* -----------------------------------------------
+* Gives a percentile of the samples, which must already be sorted
+*
+* args: samples - the sorted list, fraction - the percentile (0 to 1)
+* Returns: the sample at that percentile, or 0 if there are none
+*/
+uint32_t samples_percentile(Samples *samples, double fraction) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    size_t index = (size_t) (fraction * (samples->count - 1) + 0.5);
+    return samples->data[index];
+}
+
+/* void sample_rss(BenchRun *run)
+* -----------------------------------------------
+* Records jobthing's peak resident set size from /proc; the peak is only
+* readable while the process is alive, so it is sampled as the run goes
+*
+* args: run - the run state
+*/
+void sample_rss(BenchRun *run) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) run->pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[256];
+    long kb;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1 && kb > run->rssKb) {
+            run->rssKb = kb;
+        }
+    }
+    fclose(file);
+}
+
+/* long supervisor_cpu_ms(pid_t pid)
+* -----------------------------------------------
+* Reads the user and system time of a process itself, leaving out the time
+* of its children, from /proc/PID/stat
+*
+* args: pid - the process (which may be a zombie)
+* Returns: the CPU time in milliseconds, or -1 if it cannot be read
+*/
+long supervisor_cpu_ms(pid_t pid) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t len = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    stat[len] = '\0';
+    // Fields after the command name, which may contain spaces; utime and
+    // stime are the 14th and 15th fields overall
+    char *fields = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (fields == NULL || sscanf(fields + 2,
+            "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long) ((utime + stime) * 1000 / sysconf(_SC_CLK_TCK));
+}
+
+/* void report(const BenchArgs *args, BenchRun *run, long cpuMs, int status)
+* -----------------------------------------------
+* Prints the results of the run as a single line of key=value pairs
+*
+* args: args - the driver arguments, run - the finished run, cpuMs - the CPU
+*     time of jobthing itself, status - jobthing's wait status
+*/
+void report(const BenchArgs *args, BenchRun *run, long cpuMs, int status) {
+    double elapsed = (run->endUs - run->startUs) / 1e6;
+    Samples *latency = &run->latency;
+    qsort(latency->data, latency->count, sizeof(uint32_t), compare_samples);
+    printf("workload=%s workers=%d input=%s lines=%ld rate=%ld size=%d",
+            args->workload, args->workers,
+            args->fileInput ? "file" : "stdin", args->lines, args->rate,
+            args->size);
+    for (int i = 0; i < args->optionCount; i++) {
+        printf(" opt=%s", args->options[i]);
+    }
+    printf(" elapsed_s=%.3f lines_per_s=%.0f out_lines=%ld "
+            "out_lines_per_s=%.0f",
+            elapsed, args->lines / elapsed, run->linesOut,
+            run->linesOut / elapsed);
+    if (latency->count > 0) {
+        printf(" p50_us=%u p99_us=%u max_us=%u",
+                samples_percentile(latency, 0.5),
+                samples_percentile(latency, 0.99),
+                latency->data[latency->count - 1]);
+    } else {
+        printf(" p50_us=- p99_us=- max_us=-");
+    }
+    printf(" respawns=%ld respawns_per_s=%.1f cpu_ms=%ld rss_kb=%ld",
+            run->respawns, run->respawns / elapsed, cpuMs, run->rssKb);
+    if (WIFEXITED(status)) {
+        printf(" exit=%d\n", WEXITSTATUS(status));
+    } else {
+        printf(" exit=sig%d\n", WTERMSIG(status));
+    }
+    fflush(stdout);
+}
@@ -1,27 +1,212 @@
 // jobthing.c
 // Author: Rohith Palakirti
 //
-// Usage: ./jobthing [-v] [-i inputfile] jobfile
+// Usage: ./jobthing [-v] [-i inputfile] [-o option=value ...] jobfile
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
-#include <csse2310a3.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <spawn.h>
 
 #define READ_END 0
 #define WRITE_END 1
 #define MAX_SIZE 500
+#define MAX_EVENTS 64
+#define DRAIN_TIMEOUT_MS 1000
+#define WATCHDOG_KILL_MS 1000
+#define PIDMAP_MIN_CAPACITY 16
+#define READ_CHUNK 4096
+#define INPUT_BUFFER_SIZE 65536
+#define INPUT_RELEASE_CHUNK 8388608
+#define MAX_LINES_PER_EVENT 256
+#define POOLED_LINE_SIZE 240
+#define LINE_POOL_MAX 4096
+#define MAX_READ_PER_EVENT 65536
+#define DEFAULT_QUEUE_LIMIT 1024
+#define IOV_BATCH 64
+#define SPLICE_CHUNK 65536
+#define RING_VNODES 64
+#define DEFAULT_BACKOFF_MS 100
+#define DEFAULT_BACKOFF_MAX_MS 30000
+#define DEFAULT_STABLE_MS 1000
+#define DEFAULT_CRASHLOOP 10
+#define DEFAULT_SCALE_UP 16
+#define DEFAULT_SCALE_IDLE_MS 5000
+#define SCALE_INTERVAL_MS 500
+#define MAX_REPLICAS 1024
+#define GROUP_WINDOW 8
+#define INPUT_RING_SIZE 65536
+#define CONSOLE_RING_SIZE 1048576
+#define COLLECTOR_RING_SIZE 262144
+#define COLLECT_CHUNK 16384
+#define MAX_COLLECTORS 16
+#define COLLECT_EXIT_MS 100
+#define OUTPUT_BUFFER_SIZE 65536
+#define FLUSH_INTERVAL_MS 20
+#define MAX_RECORD_SIZE 67108864
+#define TIMER_HEAP_MIN_CAPACITY 16
+#define MAX_CONTROL_CLIENTS 16
+#define CONTROL_LINE_MAX 4096
+#define CONTROL_OUTPUT_MAX 1048576
+
+// Event loop tags: the kind of source lives in the upper 32 bits of the epoll
+// data, the job ID (if any) in the lower 32 bits
+#define EVENT_TAG(kind, id) (((uint64_t) (kind) << 32) | (uint32_t) (id))
+#define EVENT_KIND(tag) ((int) ((tag) >> 32))
+#define EVENT_ID(tag) ((int) ((tag) & 0xFFFFFFFF))
+
+// Job state flags kept in JobTable.states
+#define JOB_RUNNABLE 0x01   // the job may be (re)started
+#define JOB_ENDED 0x02      // the job has no process at the moment
+#define JOB_PIPE_IN 0x04    // the job's stdin is fed by jobthing
+#define JOB_PIPE_OUT 0x08   // the job's stdout is read by jobthing
+#define JOB_GROUPED 0x10    // the job is a member of a dispatch group
+#define JOB_REMOVED 0x20    // the job was dropped from the jobfile by a reload
+#define JOB_PAUSED 0x40     // the job's process is stopped by a control request
+#define JOB_STANDBY 0x80    // the job is a group member scaled down for now
+#define JOB_TABLE_MIN_CAPACITY 16
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+#define HIST_SUB_BITS 2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 160
 
 /*
 * Struct Definitions
 */
 
+/* SlowPolicy Enum
+* -----------------------------------------------
+* What to do with a job whose input queue is full (-o slow=...)
+* SLOW_BLOCK: stop reading the main input until the job catches up
+* SLOW_DROP: discard the oldest line queued for the job
+* SLOW_RESTART: kill the job and let the restart accounting respawn it
+*/
+typedef enum {
+    SLOW_BLOCK,
+    SLOW_DROP,
+    SLOW_RESTART
+} SlowPolicy;
+
+/* DispatchPolicy Enum
+* -----------------------------------------------
+* How the lines of the main input are shared out among a group of jobs
+* DISPATCH_BROADCAST: every job gets every line
+* DISPATCH_RR: each line goes to the next job in turn
+* DISPATCH_LEAST: each line goes to the job with the fewest lines outstanding
+* DISPATCH_HASH: each line goes to the job that owns its key on a consistent
+*     hash ring, so lines with equal keys go to the same job
+*/
+typedef enum {
+    DISPATCH_BROADCAST,
+    DISPATCH_RR,
+    DISPATCH_LEAST,
+    DISPATCH_HASH
+} DispatchPolicy;
+
+/* FrameMode Enum
+* -----------------------------------------------
+* How the records a job reads from its stdin and writes to its stdout are
+* delimited
+* FRAME_LINE: newline terminated text
+* FRAME_LENGTH: a 4-byte big-endian length followed by that many bytes
+* FRAME_NETSTRING: a netstring, the length in decimal, a colon, that many
+*     bytes and a comma
+*/
+typedef enum {
+    FRAME_LINE,
+    FRAME_LENGTH,
+    FRAME_NETSTRING
+} FrameMode;
+
+/* ReplyOrder Enum
+* -----------------------------------------------
+* Whether a job serves requests, and in which order its replies are written
+* REPLY_NONE: the job is sent plain lines and its output is written as it
+*     arrives
+* REPLY_INPUT: each line is sent prefixed with its request ID, and replies
+*     are written in the order the requests were dispatched
+* REPLY_COMPLETION: as REPLY_INPUT, but each reply is written as it arrives
+*/
+typedef enum {
+    REPLY_NONE,
+    REPLY_INPUT,
+    REPLY_COMPLETION
+} ReplyOrder;
+
+/* Options Struct
+* -----------------------------------------------
+* Tuning options given on the commandline with -o name=value
+* queueLimit: maximum number of lines queued for a job (queue=N)
+* slowPolicy: what to do when a job's queue is full (slow=block|drop|restart)
+* spliceFanout: move the main input to the jobs with tee()/splice() instead of
+*     reading it line by line (fanout=splice|copy). Directives are not
+*     interpreted, lines are not echoed or counted, and slow=drop behaves like
+*     slow=block since chunks do not end on line boundaries.
+* dispatch: the policy of the group formed by all jobs that do not name a
+*     group themselves (dispatch=broadcast|rr|least|hash)
+* keyField: the field of a line hashed by dispatch=hash, counting from 1;
+*     0 hashes the whole line (key=N)
+* backoffMs: the delay before the second quick restart in a row; it doubles
+*     with every further one (backoff=MS)
+* backoffMaxMs: the longest restart delay (backoff-max=MS)
+* stableMs: how long a run has to last to end a crash streak (stable=MS)
+* crashLoop: the number of quick exits in a row after which a job is parked
+*     instead of restarted, 0 to never park (crashloop=N)
+* metricsPath: the file metrics are written to on SIGUSR1, NULL for stderr
+*     (metrics=PATH)
+* controlPath: the Unix domain socket control requests are accepted on, NULL
+*     for none (control=PATH)
+* scaleUp: the number of unanswered lines per active member above which a
+*     group with a replica range grows (scale-up=N)
+* scaleLatencyMs: how long the oldest unanswered line of such a group may
+*     wait before it grows by a member, 0 for no limit (scale-latency=MS)
+* scaleIdleMs: how long such a group has to go without unanswered lines
+*     before it shrinks by a member (scale-idle=MS)
+* threaded: read the main input, write stdout and, unless collectors=0,
+*     read the jobs' output on threads of their own, so the event loop only
+*     dispatches (threads=on|off)
+* collectors: the number of threads reading the jobs' stdout pipes, 0 for
+*     the event loop to read them itself, -1 for one per spare CPU with
+*     threads=on and none otherwise (collectors=N)
+* flushLines: flush stdout after every line (flush=line) rather than when
+*     its buffer fills, the event loop is about to wait, or FLUSH_INTERVAL_MS
+*     have passed since the last flush (flush=batch)
+*/
+typedef struct {
+    int queueLimit;
+    SlowPolicy slowPolicy;
+    bool spliceFanout;
+    DispatchPolicy dispatch;
+    int keyField;
+    int backoffMs, backoffMaxMs, stableMs, crashLoop;
+    const char *metricsPath;
+    const char *controlPath;
+    int scaleUp, scaleLatencyMs, scaleIdleMs;
+    bool threaded, flushLines;
+    int collectors;
+} Options;
+
 /* CmdArgs Struct
 * -----------------------------------------------
 * Structure to hold the arguments parsed from the commandline
@@ -31,645 +216,6249 @@
 * jobFile: the name of the job file
 * inputFile: the name of the input file
 * mainInput: the fd of the input file
+* opts: the tuning options given with -o
 */
 typedef struct {
     bool verboseFlag, inputFileFlag, jobFileFlag;
     char jobFile[MAX_SIZE];
     char inputFile[MAX_SIZE];
     int mainInput;
+    Options opts;
 } CmdArgs;
 
+/* LineReader Struct
+* -----------------------------------------------
+* Reusable buffer for reading a stream line by line. Bytes that do not yet
+* form a complete line persist across reads, and lines are handed out as
+* views into the buffer, so reading allocates nothing once the buffer has
+* grown to fit the longest line.
+* data: the buffered bytes
+* start: the offset of the first byte not handed out yet
+* end: the offset just past the last byte read
+* cap: the allocated size of data (one byte is always kept free so that a
+*     view can be terminated in place)
+*/
+typedef struct {
+    char *data;
+    size_t start, end, cap;
+} LineReader;
+
+/* ByteRing Struct
+* -----------------------------------------------
+* Lock-free queue of bytes from one producer thread to one consumer thread.
+* Only the producer advances tail and only the consumer advances head, so
+* neither needs a lock. A side that finds the ring full (producer) or empty
+* (consumer) raises its waiting flag, checks again and then sleeps on its
+* eventfd. The other side signals that eventfd only if it sees the flag, so
+* while both sides are busy no system calls are made.
+* data: the buffer of cap bytes (a power of two)
+* head, tail: the number of bytes consumed and produced so far
+* closed: set by the producer once it will add nothing more
+* consumerWaiting, producerWaiting: set by a side about to sleep
+* dataFd: eventfd signalled when bytes arrive or the ring is closed while
+*     the consumer waits
+* spaceFd: eventfd signalled when room is freed while the producer waits
+*/
+typedef struct {
+    char *data;
+    size_t cap, head, tail;
+    int closed, consumerWaiting, producerWaiting;
+    int dataFd, spaceFd;
+} ByteRing;
+
+/* CollectCommand Struct
+* -----------------------------------------------
+* A change to the pipes an output collector reads, queued by the event loop
+* job: the job ID
+* tag: the run of the job the pipe belongs to
+* fd: the stdout pipe to read from now on, or -1 to close the job's pipe if
+*     it still belongs to that run
+*/
+typedef struct {
+    int job;
+    unsigned tag;
+    int fd;
+} CollectCommand;
+
+/* CollectHeader Struct
+* -----------------------------------------------
+* What an output collector puts in its ring ahead of each chunk of a job's
+* output
+* job: the job ID
+* tag: the run of the job the chunk was read from
+* len: the length of the chunk, 0 once the pipe has reached EOF
+*/
+typedef struct {
+    int job;
+    unsigned tag;
+    uint32_t len;
+} CollectHeader;
+
+/* Collector Struct
+* -----------------------------------------------
+* A thread reading the stdout pipes of a share of the jobs (-o collectors=N)
+* and handing what it reads to the event loop through a ring, so that the
+* event loop waits on one eventfd per collector rather than on every pipe,
+* and makes no read() calls for job output. The event loop gives a pipe to
+* a collector when a run starts and asks for it to be closed when the run
+* ends; the collector closes a pipe itself at EOF. Commands go through a
+* list under a mutex, so the event loop never waits for a collector that is
+* waiting for room in its ring.
+* thread: the collector thread
+* epollFd: what the collector waits on: its pipes and wakeFd
+* wakeFd: eventfd signalled when commands are queued
+* lock: guards commands and commandCount
+* commands, commandCount, commandCap: the queued commands
+* out: the chunks read, each after a CollectHeader
+*/
+typedef struct {
+    pthread_t thread;
+    int epollFd, wakeFd;
+    pthread_mutex_t lock;
+    CollectCommand *commands;
+    int commandCount, commandCap;
+    ByteRing out;
+} Collector;
+
+/* LineView Struct
+* -----------------------------------------------
+* A line inside a LineReader's buffer, valid until the next read into it
+* data: the line, terminated by a null byte in place of its newline
+* len: the length of the line
+*/
+typedef struct {
+    char *data;
+    size_t len;
+} LineView;
+
+/* SharedLine Struct
+* -----------------------------------------------
+* A reference counted line of input, newline included, shared by the queues
+* of every job it is sent to
+* refs: the number of queues still holding the line
+* len: the length of data
+* next: the next line in the free list, while the line is pooled
+* seq: the number of the line in the main input, which is its request ID
+* data: the line followed by a newline
+*/
+typedef struct SharedLine {
+    int refs;
+    size_t len;
+    unsigned long long seq;
+    struct SharedLine *next;
+    char data[];
+} SharedLine;
+
+/* OutQueue Struct
+* -----------------------------------------------
+* Ring of lines waiting to be written to a job's stdin pipe
+* lines: the queued lines, oldest at head
+* head: the index of the oldest line
+* count: the number of lines queued
+* cap: the allocated size of lines
+* offset: the number of bytes of the oldest line already written
+*/
+typedef struct {
+    SharedLine **lines;
+    size_t head, count, cap, offset;
+} OutQueue;
+
+/* Request Struct
+* -----------------------------------------------
+* A request sent to a job serving requests (rpc=...) that is waiting to be
+* written out
+* seq: the request ID
+* job: the job the request was sent to
+* answered: true once the job has replied, or the request was lost
+* reply: the reply, kept until the replies to the earlier requests have
+*     been written (rpc=input), NULL if there is none to write
+* replyLen: the length of reply
+*/
+typedef struct {
+    unsigned long long seq;
+    int job;
+    bool answered;
+    char *reply;
+    size_t replyLen;
+} Request;
+
+/* RequestLog Struct
+* -----------------------------------------------
+* Ring of the requests dispatched to a job, or to the members of its group,
+* in the order they were dispatched, which is also the order of their IDs.
+* Replies are matched to their request by binary search, and a request
+* leaves the log once it and every request before it have been answered.
+* items: the requests, oldest at head
+* head: the index of the oldest request
+* count: the number of requests
+* cap: the allocated size of items
+*/
+typedef struct {
+    Request *items;
+    size_t head, count, cap;
+} RequestLog;
+
+/* JobOptions Struct
+* -----------------------------------------------
+* Options of a single job, given in the jobfile after its restart count as
+* a comma separated list, e.g. "0,group=pool,dispatch=least:::cmd"
+* group: the name of the dispatch group the job belongs to (NULL if none),
+*     pointing into the text the options were parsed from
+* dispatch: the policy of the job's group (dispatch=...), if hasDispatch
+* keyField: the field hashed by dispatch=hash (key=N), if hasKey
+* deadlineMs: how soon the job has to write a line of output after being
+*     sent a line, 0 for no limit (deadline=MS)
+* idleMs: how long the job may go without writing any output, 0 for no
+*     limit (idle=MS)
+* replay: how many of the lines sent to the job that it has not answered
+*     yet are kept to be sent again to its next run, 0 for none (replay=N)
+* replicaMin, replicaMax: the range of the number of processes of the job
+*     that run at once (replicas=N or replicas=MIN-MAX), 0 if not given
+* replica: which of the job's replicas this is, counting from 0
+* frame: how the job's records are delimited (frame=line|length|netstring).
+*     Every line of the main input sent to the job becomes one record, and
+*     every record the job writes is reported as one line of output.
+* reply: whether the job serves requests, and the order its replies are
+*     written in (rpc=input|completion). A request is the record sent with
+*     its ID and a space in front; the job answers it with a record starting
+*     with the same ID, in any order.
+* window: the most requests (or, in a shared group, lines) the job may have
+*     unanswered at once, 0 for GROUP_WINDOW (window=N)
+*/
+typedef struct {
+    char *group;
+    DispatchPolicy dispatch;
+    FrameMode frame;
+    ReplyOrder reply;
+    int window;
+    int keyField;
+    bool hasDispatch, hasKey;
+    int deadlineMs, idleMs, replay;
+    int replicaMin, replicaMax, replica;
+} JobOptions;
+
+/* ArenaBlock Struct
+* -----------------------------------------------
+* One allocation of an Arena, handed out front to back
+* next: the previously filled block
+* used: the number of bytes of data handed out
+* size: the size of data
+* data: the memory handed out
+*/
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+    char data[];
+} ArenaBlock;
+
+/* Arena Struct
+* -----------------------------------------------
+* Bump allocator holding the strings and argument vectors of the jobs parsed
+* from a jobfile, so that tens of thousands of them cost a handful of
+* mallocs and are released with one call
+* head: the block currently handed out from, NULL if nothing is allocated
+*/
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+/* JobSpec Struct
+* -----------------------------------------------
+* A job as specified by one line of the jobfile; every string lives in the
+* arena the jobfile was parsed into
+* restartCount: the restart count (0 to restart forever)
+* opts: the options following the restart count
+* input, output: the input and output file names, empty for a pipe
+* cmd: the command as written in the jobfile
+* argv: cmd split into a NULL terminated argument vector
+* argc: the number of arguments in argv
+*/
+typedef struct {
+    int restartCount;
+    JobOptions opts;
+    char *input, *output, *cmd;
+    char **argv;
+    int argc;
+} JobSpec;
+
+/* Histogram Struct
+* -----------------------------------------------
+* HDR style histogram of durations in microseconds. Values below
+* HIST_SUB_BUCKETS have a bucket each; above that every power of two is split
+* into HIST_SUB_BUCKETS equal buckets, so a value is known to within 25% at
+* any magnitude, with a fixed size and O(1) recording.
+* counts: the number of values in each bucket
+* count: the number of values recorded
+* sum: the sum of the values recorded
+* max: the largest value recorded
+*/
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t count, sum, max;
+} Histogram;
+
+/* JobMetrics Struct
+* -----------------------------------------------
+* Counters kept for each job across all of its runs, reported on SIGUSR1
+* linesIn, bytesIn: the lines queued for and bytes written to the job
+* bytesOut: the bytes of output read from the job
+* dropped: the lines discarded under slow=drop
+* exits, signals: the number of runs that ended with an exit code or signal
+* timeouts: the number of runs terminated for missing a deadline or idling
+* replayed: the lines sent again to a restarted run of the job
+* lastExit, lastSignal: the most recent exit code and signal, -1 if none
+* awaitingSince: CLOCK_MONOTONIC time in us at which the oldest line the job
+*     has not produced output for since was sent, 0 if none
+* latency: input-to-first-output latencies, allocated on the first sample
+*/
+typedef struct {
+    unsigned long long linesIn, bytesIn, bytesOut, dropped, replayed;
+    int exits, signals, lastExit, lastSignal, timeouts;
+    long long awaitingSince;
+    Histogram *latency;
+} JobMetrics;
+
 /* JobProps Struct
 * -----------------------------------------------
-* Structure to hold the properties of each job parsed from the job file
+* Structure to hold the properties of each job parsed from the job file that
+* the event loop does not need on every line; the rest is in JobTable
 * jobID: ID of the job
-* jobPipeIn[2], jobPipeOut[2]: fds for input/output pipes between child process
-*    and jobthing
-* 
+* jobInput, jobOutput: the job's input and output files, -2 if the job is
+*     connected to jobthing by a pipe instead; for a linked job, the ends of
+*     the link pipe it is started with
+* inputPath, outputPath: the names of the input and output files as given in
+*     the jobfile, empty for a pipe; an input of @N reads the stdout of job N
+* upstream: the job whose stdout this job reads through a link pipe, 0 if
+*     none
+* downstream: the job reading this job's stdout through a link pipe, 0 if
+*     none
+* linkFd: the supervisor's copy of the write end of the link pipe this job
+*     reads, -1 if none. The supervisor keeps both ends of a link open until
+*     the main input ends, so either job can be restarted without the other
+*     seeing EOF or EPIPE, and without losing what is buffered in the pipe.
 * restartCount: number of times the job needs to be respawned
 * status: status of the job as reported by waitpid
 * jobCmd: the command and the supplied arguments for the job
-* infiniteRestart: boolean to indicate if the job is respawned continuously 
+* argv: jobCmd split into a NULL terminated argument vector at registration
+* outBuf: output read from the job's stdout pipe but not reported yet
+* inQueue: lines waiting to be written to the job's stdin pipe
+* inFlight: the lines sent to the current run of the job that it has not
+*     answered yet
+* requests: the requests dispatched to the job (rpc=...) not yet written
+*     out, unless it is in a dispatch group, which keeps them instead
+* replay: lines sent to the job that it has not written a line of output for
+*     yet, oldest at head, kept if the job has a replay ring; a NULL entry
+*     stands for a line that was dropped before the job got it
+* writeWatched: true while the event loop waits for the stdin pipe to be
+*     writable
+* teeOffset: bytes of the current spliced chunk that reached the job's pipe
+* opts: the options given for the job in the jobfile
+* group: index of the job's dispatch group in the supervisor, -1 if the job
+*     receives every line
+* startedAt: CLOCK_MONOTONIC time in ms at which the current run started
+* restartAt: CLOCK_MONOTONIC time in ms at which a delayed restart is due, 0
+*     if none is scheduled
+* crashStreak: the number of runs in a row that ended within the stability
+*     window
+* stopAt: CLOCK_MONOTONIC time in ms at which a job being stopped by a reload
+*     is sent SIGTERM, 0 if the job is not being stopped
+* replacing: true while the process of a job whose specification changed on
+*     reload is stopped, so that the new specification starts once it exits
+* restartRequested: true while the process of a job is being terminated by a
+*     control request, so that it is started again at once when it exits
+* lastOutputAt: CLOCK_MONOTONIC time in ms of the job's latest output, or of
+*     the start of its run (only kept if the job has an idle timeout)
+* watchdogAt: CLOCK_MONOTONIC time in ms at which the job's deadline and idle
+*     timeout are next checked, 0 if no check is scheduled
+* killAt: CLOCK_MONOTONIC time in ms at which a job terminated by its
+*     watchdog is sent SIGKILL, 0 if it is not being terminated
+* frame: the framing of the job's current run, which a reload changes only
+*     from its next run
+* outTag: the run of the job whose output collector messages are taken
+* exitAt: CLOCK_MONOTONIC time in ms until which reporting the exit of a job
+*     whose process has been reaped waits for its collector to reach the EOF
+*     of its stdout pipe, 0 if no exit is waiting
+* exitStatus: the status of the exit that is waiting
+* metrics: the job's counters
+* infiniteRestart: boolean to indicate if the job is respawned continuously
     (numRestarts = 0)
-* runnable: flag to indicate if the job is runnable
-* ended: flag to indicate if the job has ended
-* runs: number of times the job has run
-* linesto: numbers of lines of input that have been sent to the job
 */
 typedef struct {
-    int jobID, jobPipeIn[2], jobPipeOut[2], jobInput, jobOutput, restartCount,
-            status;
-    char jobCmd[MAX_SIZE];
-    bool infiniteRestart, runnable;
-    bool ended;
-    int runs, linesto;
+    int jobID, jobInput, jobOutput, restartCount, status;
+    char *inputPath, *outputPath;
+    int upstream, downstream, linkFd;
+    char *jobCmd;
+    char **argv;
+    LineReader outBuf;
+    OutQueue inQueue, replay;
+    int inFlight;
+    RequestLog requests;
+    bool writeWatched;
+    size_t teeOffset;
+    JobOptions opts;
+    int group;
+    long long startedAt, restartAt, stopAt;
+    long long lastOutputAt, watchdogAt, killAt;
+    int crashStreak;
+    bool replacing, restartRequested;
+    FrameMode frame;
+    unsigned outTag;
+    long long exitAt;
+    int exitStatus;
+    JobMetrics metrics;
+    bool infiniteRestart;
 } JobProps;
 
+/* JobTable Struct
+* -----------------------------------------------
+* The registered jobs, indexed by job ID (index 0 is unused). What the event
+* loop looks at for every job on every line is kept in parallel arrays, so a
+* scan over thousands of jobs touches a few bytes per job rather than a whole
+* JobProps each.
+* count: the number of registered jobs
+* cap: the allocated length of each array
+* pids: the pid of the current process of each job
+* inFds: jobthing's end of each job's stdin pipe, -1 if there is none
+* outFds: jobthing's end of each job's stdout pipe, -1 if there is none
+* states: the JOB_* flags of each job
+* runs: number of times each job has run
+* linesto: numbers of lines of input that have been sent to each job
+* linesfrom: number of lines of output received from each job
+* props: everything else about each job
+*/
+typedef struct {
+    int count, cap;
+    pid_t *pids;
+    int *inFds, *outFds;
+    uint8_t *states;
+    volatile sig_atomic_t *runs, *linesto;
+    int *linesfrom;
+    JobProps *props;
+} JobTable;
+
+/* EventKind Enum
+* -----------------------------------------------
+* The sources the supervisor event loop waits on
+* EV_STDIN: the main input (stdin or the -i input file)
+* EV_CHILD: the signalfd that delivers SIGCHLD
+* EV_JOB_OUT: the stdout pipe of a job
+* EV_JOB_IN: the stdin pipe of a job, watched while lines are queued for it
+* EV_RELOAD: the pipe the SIGHUP handler writes to to request a reload
+* EV_CONTROL: the listening control socket
+* EV_CONTROL_CLIENT: a connection to the control socket
+* EV_COLLECTOR: the ring an output collector hands job output over in
+*/
+typedef enum {
+    EV_STDIN,
+    EV_CHILD,
+    EV_JOB_OUT,
+    EV_JOB_IN,
+    EV_RELOAD,
+    EV_CONTROL,
+    EV_CONTROL_CLIENT,
+    EV_COLLECTOR
+} EventKind;
+
+/* PidMap Struct
+* -----------------------------------------------
+* Open addressing hash table mapping the pid of a running job process to its
+* job ID, so that an exited child is matched to its job in O(1)
+* pids: the keys (0 marks an empty slot, -1 a deleted one)
+* ids: the job ID stored with each key
+* capacity: the number of slots (always a power of two)
+* used: the number of slots that are not empty (live or deleted)
+*/
+typedef struct {
+    pid_t *pids;
+    int *ids;
+    size_t capacity, used;
+} PidMap;
+
+/* JobGroup Struct
+* -----------------------------------------------
+* A set of jobs that share the main input: each line goes to exactly one of
+* them, chosen by the group's dispatch policy
+* name: the group name from the jobfile (NULL for the commandline group)
+* policy: the dispatch policy
+* keyField: the field hashed under DISPATCH_HASH (0 for the whole line)
+* members: the job IDs in the group
+* memberCount: the number of members
+* cursor: the member to try first under DISPATCH_RR and DISPATCH_LEAST
+* ringHashes, ringMembers: the consistent hash ring, sorted by hash, with
+*     RING_VNODES points per member (DISPATCH_HASH only)
+* ringSize: the number of points on the ring
+* scaleMin, scaleMax: the replica range of the group's first member, within
+*     which the group is resized to its load (equal if it is not resized)
+* idleSince: CLOCK_MONOTONIC time in ms since which the group has had no
+*     unanswered lines, 0 if it has some
+* shared: true if the members take their lines from one queue of the group
+*     (the replicas of a job, unless they are dispatched by hash)
+* queue: the lines read for a shared group that no member has taken yet
+* dropped: the lines discarded from queue because it was full
+* requests: the requests dispatched to the members (rpc=...) not yet written
+*     out
+*/
+typedef struct {
+    char *name;
+    DispatchPolicy policy;
+    int keyField;
+    int *members;
+    int memberCount, cursor;
+    uint32_t *ringHashes;
+    int *ringMembers;
+    int ringSize;
+    int scaleMin, scaleMax;
+    long long idleSince;
+    bool shared;
+    OutQueue queue;
+    unsigned long long dropped;
+    RequestLog requests;
+} JobGroup;
+
+/* TimerKind Enum
+* -----------------------------------------------
+* What a timer does when it falls due
+* TIMER_RESTART: restarts a job whose restart was delayed
+* TIMER_STOP: sends SIGTERM to a job stopped by a reload that has not exited
+* TIMER_INPUT: resumes reading the main input after a *sleep directive
+* TIMER_WATCHDOG: checks a job's response deadline and idle timeout
+* TIMER_KILL: sends SIGKILL to a job its watchdog terminated that has not
+*     exited
+* TIMER_SCALE: resizes the groups that have a replica range to their load
+* TIMER_EXIT: reports the exit of a job whose collector has not reached the
+*     EOF of its stdout pipe in time
+*/
+typedef enum {
+    TIMER_RESTART,
+    TIMER_STOP,
+    TIMER_INPUT,
+    TIMER_WATCHDOG,
+    TIMER_KILL,
+    TIMER_SCALE,
+    TIMER_EXIT
+} TimerKind;
+
+/* Timer Struct
+* -----------------------------------------------
+* An entry of the timer heap. Timers are never removed early: the state they
+* act on records the due time it expects (e.g. JobProps.restartAt), and an
+* entry that no longer matches it is discarded when it is popped.
+* due: CLOCK_MONOTONIC time in ms at which the timer falls due
+* kind: what the timer does
+* id: the job ID the timer applies to, 0 for TIMER_INPUT
+*/
+typedef struct {
+    long long due;
+    TimerKind kind;
+    int id;
+} Timer;
+
+/* TimerHeap Struct
+* -----------------------------------------------
+* Binary min-heap of timers ordered by due time, so the next timer is found
+* in O(1) and timers are added and popped in O(log n)
+* items: the timers, the earliest first
+* count: the number of timers
+* cap: the allocated length of items
+*/
+typedef struct {
+    Timer *items;
+    int count, cap;
+} TimerHeap;
+
+/* ControlClient Struct
+* -----------------------------------------------
+* A connection to the control socket. Requests and responses are one line
+* each; responses are buffered so that a client that reads slowly never
+* blocks the supervisor.
+* fd: the connected socket, -1 if the slot is free
+* in: requests read but not handled yet
+* out: responses not written yet
+* outLen, outOff, outCap: the length of out, the number of its bytes already
+*     written and its allocated size
+* closing: set once the client has shut down its side; the connection is
+*     closed when the remaining responses have been written
+*/
+typedef struct {
+    int fd;
+    LineReader in;
+    char *out;
+    size_t outLen, outOff, outCap;
+    bool closing;
+} ControlClient;
+
+/* Supervisor Struct
+* -----------------------------------------------
+* Structure to hold the runtime state of the supervisor event loop
+* args: the parsed command line arguments
+* jobs: the registered jobs
+* arena: the strings and argument vectors of the registered jobs
+* viableWorkers: the number of jobs that are currently running
+* epollFd: the epoll instance waiting on stdin, job pipes and child exits
+* childFd: signalfd receiving SIGCHLD and SIGUSR1
+* pidMap: maps the pid of each running job process to its job ID
+* stdinPollable: false if stdin is a regular file, which epoll cannot wait on
+*     and which is therefore always treated as readable
+* inputWatched: true while the event loop is reading the main input
+* input: the reader for the main input, whose buffer is a mapping of the
+*     whole file if inputMapped
+* inputMapped: true if the main input is a regular file read through a
+*     mapping rather than read()
+* inputReleased: the offset in the mapped input up to which its pages have
+*     been given back
+* inputPending: true if reading the main input stopped with lines possibly
+*     left in the reader
+* inputRing: where the input thread leaves the main input, NULL if the event
+*     loop reads stdin itself
+* inputThread: the thread reading stdin into inputRing
+* inputFd: what the event loop waits on for the main input: stdin, or the
+*     eventfd of inputRing
+* collectors: the output collector threads, NULL if the event loop reads the
+*     jobs' stdout pipes itself
+* collectorCount: the number of collectors
+* collectPending: true if taking output from a collector stopped with some
+*     possibly left in its ring
+* fullQueues: the number of jobs and groups whose input queue has reached
+*     the limit
+* stagePipe: pipe the main input is spliced into before being teed to the jobs
+*     (-o fanout=splice only)
+* nullFd: /dev/null, where fully teed chunks are spliced to be discarded
+* groups: the dispatch groups
+* groupCount: the number of dispatch groups
+* failedSpawns: IDs of jobs whose command could not be executed, to be
+*     reported as exiting with code 99 on the next pass of the event loop
+* failedCount, failedCap: the number of entries in and the size of
+*     failedSpawns
+* pendingRestarts: the number of jobs waiting for a delayed restart
+* pendingStops: the number of jobs removed or replaced by a reload that are
+*     given until their stopAt time to exit
+* timers: the delayed restarts, stop deadlines and *sleep wakeups
+* sleepUntil: CLOCK_MONOTONIC time in ms until which reading the main input
+*     is suspended by a *sleep directive, 0 if it is not
+* scaleAt: CLOCK_MONOTONIC time in ms at which the groups are next resized to
+*     their load, 0 if no group has a replica range
+* draining: set once stdin reaches EOF; remaining output is collected until
+*     drainDeadline before exiting
+* drainDeadline: CLOCK_MONOTONIC time in ms at which draining gives up
+* flushedAt: CLOCK_MONOTONIC time in ms at which stdout was last flushed by
+*     the event loop
+* startedAt: CLOCK_MONOTONIC time in ms at which the supervisor started
+* linesRead: the number of lines read from the main input
+* inputPaused: true while reading the main input is paused by a control
+*     request
+* controlFd: the listening control socket, -1 if there is none
+* clients: the control connections, MAX_CONTROL_CLIENTS slots
+*/
+typedef struct {
+    CmdArgs args;
+    JobTable jobs;
+    Arena arena;
+    int viableWorkers;
+    int epollFd, childFd, stagePipe[2], nullFd;
+    PidMap pidMap;
+    JobGroup *groups;
+    int groupCount;
+    int *failedSpawns;
+    int failedCount, failedCap;
+    int pendingRestarts, pendingStops;
+    TimerHeap timers;
+    long long sleepUntil, scaleAt;
+    LineReader input;
+    bool inputMapped;
+    size_t inputReleased;
+    ByteRing *inputRing;
+    pthread_t inputThread;
+    int inputFd;
+    Collector *collectors;
+    int collectorCount;
+    bool collectPending;
+    bool stdinPollable, inputWatched, inputPending, draining;
+    int fullQueues;
+    long long drainDeadline, flushedAt;
+    long long startedAt;
+    unsigned long long linesRead;
+    bool inputPaused;
+    int controlFd;
+    ControlClient *clients;
+} Supervisor;
+
 /*
  * Function Prototypes
  */
 CmdArgs parse_command_line_args(int argc, char *argv[]);
+void set_default_options(Options *opts);
+bool parse_number(const char *text, long min, long *value);
+bool parse_option(Options *opts, char *option);
+bool parse_dispatch_policy(const char *text, DispatchPolicy *policy);
+bool parse_frame_mode(const char *text, FrameMode *mode);
+void set_default_job_options(JobOptions *opts);
+bool parse_job_options(JobOptions *opts, char *optionList);
+bool parse_replicas(const char *text, JobOptions *opts);
 void print_std_err(int value);
+void end_console_line(Supervisor *sv);
 char *parse_inputfile_path(int argc, char *arg, bool flag);
 char *parse_jobfile_path(int argc, char *arg, bool flag);
-FILE *open_jobfile(char *filepath);
-FILE *open_inputfile(char *filepath);
-char *trim_whitespace(char *str);
-int count_colons(char *line);
-void child_handler(int s);
-pid_t spawn_child(int *i, int *jobInputList, int *jobOutputList,
-        char jobCmdList[50], int jobPipeIn[2], int jobPipeOut[2]);
+char *map_jobfile(const char *path, size_t *size, bool *mapped);
+int load_jobfile(Supervisor *sv, const char *path);
+JobSpec *parse_jobfile(Supervisor *sv, const char *path, Arena *arena,
+        int *count);
+JobSpec *add_replicas(Arena *arena, JobSpec *specs, int *count, int *cap);
+void reload_jobfile(Supervisor *sv);
+int match_jobs(Supervisor *sv, JobSpec *specs, int count, int *matches);
+uint32_t hash_job_identity(const char *cmd, const char *input,
+        const char *output);
+void apply_job_spec(Supervisor *sv, int id, JobSpec *spec);
+bool open_job_files(Supervisor *sv, int id);
+bool prepare_job(Supervisor *sv, int id);
+int link_jobs(Supervisor *sv);
+bool link_job(Supervisor *sv, int i);
+void unlink_job(Supervisor *sv, int i);
+void close_links(Supervisor *sv);
+void stop_job(Supervisor *sv, int i);
+void free_groups(JobGroup *groups, int count);
+void carry_group_queues(Supervisor *sv, JobGroup *old, int oldCount);
+bool parse_job_spec(Arena *arena, const char *text, size_t len,
+        JobSpec *spec);
+char **split_command(Arena *arena, const char *cmd, int *count);
+bool register_job(Supervisor *sv, JobSpec *spec);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *text, size_t len);
+void arena_free(Arena *arena);
+pid_t spawn_child(JobProps *job, int *inFd, int *outFd);
 void sig_handler(int signo);
+size_t format_int(char *buf, long value);
+int jobtable_add(JobTable *table);
+void jobtable_free(JobTable *table);
+void setup_event_loop(Supervisor *sv);
+void epoll_watch(int epollFd, int fd, EventKind kind, int id);
+long long now_ms(void);
+long long now_us(void);
+void record_latency(JobMetrics *metrics, long long value);
+int hist_bucket(uint64_t value);
+uint64_t hist_bucket_start(int bucket);
+uint64_t hist_percentile(Histogram *hist, double percentile);
+void write_metrics(Supervisor *sv);
+void write_metrics_json(Supervisor *sv, FILE *out);
+void write_job_metrics(Supervisor *sv, FILE *out, int i, long long now);
+void write_group_metrics(Supervisor *sv, FILE *out, int g);
+void write_json_string(FILE *out, const char *text);
+void start_job(Supervisor *sv, int i);
+void close_job_pipes(Supervisor *sv, int i);
+void handle_signals(Supervisor *sv);
+void reap_jobs(Supervisor *sv);
+void reap_failed_spawns(Supervisor *sv);
+void handle_job_exit(Supervisor *sv, int i, int status);
+long long restart_delay(Supervisor *sv, JobProps *job, long long ranFor);
+void restart_job(Supervisor *sv, int i);
+void schedule_timer(Supervisor *sv, long long due, TimerKind kind, int id);
+void timer_pop(TimerHeap *heap);
+void run_due_timers(Supervisor *sv);
+void autoscale(Supervisor *sv);
+int scale_group(Supervisor *sv, int g, int wanted);
+int active_members(Supervisor *sv, JobGroup *group);
+int next_timeout(Supervisor *sv);
+void arm_watchdog(Supervisor *sv, int i);
+void check_watchdog(Supervisor *sv, int i);
+void terminate_hung_job(Supervisor *sv, int i, const char *reason);
+size_t pidmap_slot(PidMap *map, pid_t pid);
+void pidmap_insert(PidMap *map, pid_t pid, int id);
+int pidmap_remove(PidMap *map, pid_t pid);
+void check_viable_workers(Supervisor *sv);
+void read_job_output(Supervisor *sv, int j);
+void emit_job_lines(Supervisor *sv, int j, bool atEof);
+void reader_init(LineReader *reader, size_t cap);
+size_t reader_reserve(LineReader *reader);
+ssize_t fill_input(Supervisor *sv);
+bool map_input(Supervisor *sv);
+bool map_next(LineReader *reader, LineView *line);
+void release_input(Supervisor *sv);
+void byte_ring_init(ByteRing *ring, size_t cap, bool pollable);
+size_t byte_ring_space(ByteRing *ring, struct iovec iov[2]);
+void byte_ring_commit(ByteRing *ring, size_t len);
+size_t byte_ring_peek(ByteRing *ring, struct iovec iov[2]);
+void byte_ring_consume(ByteRing *ring, size_t len);
+void byte_ring_close(ByteRing *ring);
+bool byte_ring_idle(ByteRing *ring);
+bool byte_ring_wait_data(ByteRing *ring);
+void byte_ring_wait_space(ByteRing *ring, size_t need);
+void byte_ring_write(ByteRing *ring, const void *data, size_t len);
+void byte_ring_read(ByteRing *ring, void *data, size_t len);
+void byte_ring_wake(int *waiting, int fd);
+void start_thread(pthread_t *thread, void *(*run)(void *), void *arg);
+void *input_thread(void *arg);
+void start_console_writer(void);
+void stop_console_writer(void);
+ssize_t console_write(void *cookie, const char *data, size_t len);
+void *console_thread(void *arg);
+void start_collectors(Supervisor *sv);
+void *collector_thread(void *arg);
+void collector_command(Collector *collector, int job, unsigned tag, int fd);
+void collector_send(Collector *collector, const void *message, size_t len);
+void collect_output(Supervisor *sv, int c);
+void take_collected(Supervisor *sv, ByteRing *ring, CollectHeader *header);
+void close_job_output(Supervisor *sv, int j);
+ssize_t reader_fill(LineReader *reader, int fd);
+bool reader_next(LineReader *reader, LineView *line, bool atEof);
+int record_next(LineReader *reader, LineView *record, FrameMode mode,
+        bool atEof);
+size_t frame_size(FrameMode mode, SharedLine *line, bool tagged);
+int frame_line(FrameMode mode, SharedLine *line, bool tagged, size_t skip,
+        char *header,
+        struct iovec *iov);
+int split_fields(char *text, char sep, char **fields, int max);
+void read_input(Supervisor *sv, bool readable);
+void handle_input_line(Supervisor *sv, LineView *line);
+void handle_directive(Supervisor *sv, char *inputLine);
+void dispatch_line(Supervisor *sv, const char *text, size_t len);
+void build_groups(Supervisor *sv);
+int find_group(Supervisor *sv, const char *name, DispatchPolicy policy,
+        int keyField);
+void build_hash_ring(JobGroup *group);
+int compare_ring_points(const void *a, const void *b);
+uint32_t hash_bytes(const char *data, size_t len);
+uint32_t mix_hash(uint32_t value);
+bool can_dispatch(JobTable *jobs, int j);
+int pick_member(Supervisor *sv, JobGroup *group, SharedLine *line);
+long member_load(Supervisor *sv, int j);
+void group_enqueue(Supervisor *sv, int g, SharedLine *line);
+void feed_group(Supervisor *sv, int g);
+bool group_pending(Supervisor *sv, int j);
+bool same_group_name(const char *name, const char *other);
+int pick_by_hash(Supervisor *sv, JobGroup *group, SharedLine *line);
+SharedLine *shared_line_new(const char *text, size_t len);
+SharedLine *shared_line_alloc(size_t len);
+void shared_line_release(SharedLine *line);
+void queue_push(OutQueue *queue, SharedLine *line);
+SharedLine *queue_drop_oldest(OutQueue *queue);
+void queue_clear(Supervisor *sv, int j);
+size_t replay_limit(Supervisor *sv, int j);
+void replay_record(Supervisor *sv, int j, SharedLine *line);
+void replay_answer(OutQueue *ring, unsigned long long seq);
+bool serves_requests(Supervisor *sv, int j);
+int job_window(Supervisor *sv, int j);
+size_t sendable_lines(Supervisor *sv, int j);
+RequestLog *request_log(Supervisor *sv, int j);
+void request_push(RequestLog *log, unsigned long long seq, int j);
+void answer_request(Supervisor *sv, int j, LineView *reply);
+void lose_requests(Supervisor *sv, int j, bool all);
+void lose_request(Supervisor *sv, int j, unsigned long long seq);
+void release_requests(Supervisor *sv, RequestLog *log, bool force);
+void release_all_requests(Supervisor *sv);
+Request *find_request(RequestLog *log, unsigned long long seq, int j);
+bool request_in_ring(OutQueue *ring, unsigned long long seq);
+void report_output(Supervisor *sv, int j, const char *data, size_t len);
+void replay_trim(OutQueue *ring, size_t keep);
+void replay_ack(OutQueue *ring);
+void replay_forget(OutQueue *ring, SharedLine *line);
+void replay_lines(Supervisor *sv, int j);
+bool make_room(Supervisor *sv, int j);
+void enqueue_line(Supervisor *sv, int j, SharedLine *line);
+void splice_input(Supervisor *sv);
+void enqueue_chunk_tail(Supervisor *sv, int j, SharedLine *chunk);
+void flush_job_queue(Supervisor *sv, int j);
+void set_write_interest(Supervisor *sv, int j, bool want);
+bool input_wanted(Supervisor *sv);
+void update_input_interest(Supervisor *sv);
+void begin_drain(Supervisor *sv);
+bool drain_finished(Supervisor *sv);
+void run_event_loop(Supervisor *sv);
+void setup_control_socket(Supervisor *sv);
+void close_control_socket(Supervisor *sv);
+void accept_control_clients(Supervisor *sv);
+void handle_control_client(Supervisor *sv, int c, uint32_t events);
+void serve_control_requests(Supervisor *sv, int c);
+void run_control_request(Supervisor *sv, char *request, FILE *out);
+void control_error(FILE *out, const char *message);
+bool parse_control_job(Supervisor *sv, const char *text, int *id,
+        FILE *out);
+void control_restart(Supervisor *sv, int i, FILE *out);
+void control_scale(Supervisor *sv, const char *name, const char *size,
+        FILE *out);
+void control_pause(Supervisor *sv, const char *job, bool pause, FILE *out);
+void control_send(Supervisor *sv, int c, const char *data, size_t len);
+void flush_control_client(Supervisor *sv, int c);
+void set_control_interest(Supervisor *sv, int c);
+void close_control_client(Supervisor *sv, int c);
+
+// The job table whose counters are reported on SIGHUP
+JobTable *statsTable = NULL;
+
+// Pipe the SIGHUP handler writes to so the event loop reloads the jobfile
+int reloadPipe[2] = {-1, -1};
+
+// Released lines of up to POOLED_LINE_SIZE bytes, kept for reuse so that
+// dispatching a line does not normally allocate
+SharedLine *linePool = NULL;
+int linePoolSize = 0;
+
+// With -o threads=on, stdout is written by consoleThread from consoleRing
+ByteRing consoleRing;
+pthread_t consoleThread;
+
+/* int main(int argc, char *argv[])
+* -----------------------------------------------
+* Main function for the jobthing program
+*
+* args: int argc, char *argv[]
+* Returns: 0 on success
+* Errors: exits with various exit codes {1, 2, 3, 99} on failure
+*/
+int main(int argc, char *argv[]) {
+    // Signal handling
+    Supervisor sv;
+    memset(&sv, 0, sizeof(sv));
+    statsTable = &sv.jobs;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, 0);
+    sigaction(SIGPIPE, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+
+    CmdArgs args = parse_command_line_args(argc, argv);
+    sv.args = args;
+    if (!args.opts.flushLines) {
+        // Fully buffered even on a terminal; the event loop flushes it
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+    if (args.opts.threaded) {
+        start_console_writer();
+    }
+    int invalidJobs = load_jobfile(&sv, args.jobFile);
+    sv.viableWorkers = sv.jobs.count - invalidJobs;
+    // build_groups schedules the first resize of groups with a replica
+    // range, so the timer heap must exist first
+    setup_event_loop(&sv);
+    build_groups(&sv);
+    for (int i = 1; i <= sv.jobs.count; i++) {
+        if (sv.jobs.states[i] & JOB_RUNNABLE) {
+            start_job(&sv, i);
+            if (args.verboseFlag) {
+                printf("Spawning worker %d\n", i);
+                end_console_line(&sv);
+            }
+        }
+    }
+    run_event_loop(&sv);
+    return 0;
+}
+
+/* void sig_handler(int signo)
+* -----------------------------------------------
+* This function is called when a signal is received. On SIGHUP the run and
+* line counts of every job are written to stderr and the event loop is asked
+* to reload the jobfile; only async-signal-safe calls are made, since the
+* signal may arrive in the middle of a stdio call.
+*
+* args: signo - the signal number
+*/
+void sig_handler(int signo) {
+    if (signo != SIGHUP || statsTable == NULL) {
+        return;
+    }
+    int savedErrno = errno;
+    if (reloadPipe[WRITE_END] >= 0
+            && write(reloadPipe[WRITE_END], "", 1) == -1) {
+        // The pipe is full, so a reload is already pending
+    }
+    char line[64];
+    for (int i = 1; i <= statsTable->count; i++) {
+        size_t len = format_int(line, i);
+        line[len++] = ':';
+        len += format_int(line + len, statsTable->runs[i]);
+        line[len++] = ':';
+        len += format_int(line + len, statsTable->linesto[i]);
+        line[len++] = '\n';
+        if (write(STDERR_FILENO, line, len) == -1) {
+            break;
+        }
+    }
+    errno = savedErrno;
+}
+
+/* size_t format_int(char *buf, long value)
+* -----------------------------------------------
+* Writes a number in decimal without going through stdio, so that it can be
+* used from a signal handler
+*
+* args: buf - where the digits are written (at least 21 bytes), value - the
+*     number
+* Returns: the number of characters written (no terminator is added)
+*/
+size_t format_int(char *buf, long value) {
+    char digits[24];
+    size_t count = 0;
+    unsigned long magnitude = (value < 0) ? -(unsigned long) value : value;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    size_t len = 0;
+    if (value < 0) {
+        buf[len++] = '-';
+    }
+    while (count > 0) {
+        buf[len++] = digits[--count];
+    }
+    return len;
+}
+
+/* int jobtable_add(JobTable *table)
+* -----------------------------------------------
+* Registers a new job, growing the table as needed. SIGHUP is blocked while
+* the arrays move so the handler never reads from freed memory.
+*
+* args: table - the job table
+* Returns: the ID of the new job, whose entries are zeroed apart from its
+*     pipes, which are marked closed
+*/
+int jobtable_add(JobTable *table) {
+    if (table->count + 1 >= table->cap) {
+        int cap = table->cap ? table->cap * 2 : JOB_TABLE_MIN_CAPACITY;
+        sigset_t hupMask, oldMask;
+        sigemptyset(&hupMask);
+        sigaddset(&hupMask, SIGHUP);
+        sigprocmask(SIG_BLOCK, &hupMask, &oldMask);
+        table->pids = realloc(table->pids, sizeof(pid_t) * cap);
+        table->inFds = realloc(table->inFds, sizeof(int) * cap);
+        table->outFds = realloc(table->outFds, sizeof(int) * cap);
+        table->states = realloc(table->states, sizeof(uint8_t) * cap);
+        table->runs = realloc((void *) table->runs,
+                sizeof(sig_atomic_t) * cap);
+        table->linesto = realloc((void *) table->linesto,
+                sizeof(sig_atomic_t) * cap);
+        table->linesfrom = realloc(table->linesfrom, sizeof(int) * cap);
+        table->props = realloc(table->props, sizeof(JobProps) * cap);
+        table->cap = cap;
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    }
+    int id = table->count + 1;
+    table->pids[id] = 0;
+    table->inFds[id] = table->outFds[id] = -1;
+    table->states[id] = 0;
+    table->runs[id] = table->linesto[id] = 0;
+    table->linesfrom[id] = 0;
+    memset(&table->props[id], 0, sizeof(JobProps));
+    // Only counted once its entries are valid, for the SIGHUP handler
+    table->count = id;
+    return id;
+}
+
+/* void jobtable_free(JobTable *table)
+* -----------------------------------------------
+* Releases the job table
+*
+* args: table - the job table
+*/
+void jobtable_free(JobTable *table) {
+    statsTable = NULL;
+    for (int i = 1; i <= table->count; i++) {
+        free(table->props[i].outBuf.data);
+        free(table->props[i].inQueue.lines);
+        free(table->props[i].replay.lines);
+        free(table->props[i].requests.items);
+        free(table->props[i].metrics.latency);
+    }
+    free(table->pids);
+    free(table->inFds);
+    free(table->outFds);
+    free(table->states);
+    free((void *) table->runs);
+    free((void *) table->linesto);
+    free(table->linesfrom);
+    free(table->props);
+    memset(table, 0, sizeof(JobTable));
+}
+
+/* long long now_ms(void)
+* -----------------------------------------------
+* Reads the monotonic clock
+*
+* Returns: the current CLOCK_MONOTONIC time in milliseconds
+*/
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* long long now_us(void)
+* -----------------------------------------------
+* Reads the monotonic clock with microsecond resolution
+*
+* Returns: the current CLOCK_MONOTONIC time in microseconds
+*/
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* void epoll_watch(int epollFd, int fd, EventKind kind, int id)
+* -----------------------------------------------
+* Registers a file descriptor for readability with the event loop
+*
+* args: epollFd - the epoll instance, fd - the descriptor to watch,
+*     kind - the kind of event source, id - the job ID (0 if not a job)
+* Errors: exits with code 4 if the descriptor cannot be registered
+*/
+void epoll_watch(int epollFd, int fd, EventKind kind, int id) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_TAG(kind, id);
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(4);
+    }
+}
+
+/* void setup_event_loop(Supervisor *sv)
+* -----------------------------------------------
+* Creates the epoll instance and the SIGCHLD signalfd, and registers stdin.
+* SIGCHLD stays blocked for the lifetime of the supervisor so that it is only
+* ever delivered through the signalfd.
+*
+* args: sv - the supervisor state
+* Errors: exits with code 4 if the event loop cannot be created
+*/
+void setup_event_loop(Supervisor *sv) {
+    sv->draining = false;
+    sv->drainDeadline = 0;
+    sv->fullQueues = 0;
+    sv->failedSpawns = NULL;
+    sv->failedCount = sv->failedCap = 0;
+    sv->pendingRestarts = sv->pendingStops = 0;
+    memset(&sv->timers, 0, sizeof(sv->timers));
+    sv->sleepUntil = 0;
+    sv->startedAt = now_ms();
+    sv->linesRead = 0;
+    srandom(time(NULL) ^ getpid());
+    sv->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (sv->args.opts.spliceFanout) {
+        sv->nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (sv->nullFd == -1
+                || pipe2(sv->stagePipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+            perror("splice fanout");
+            exit(4);
+        }
+        fcntl(sv->stagePipe[WRITE_END], F_SETPIPE_SZ, SPLICE_CHUNK);
+    }
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigaddset(&childMask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &childMask, NULL);
+    sv->childFd = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sv->epollFd == -1 || sv->childFd == -1) {
+        perror("event loop");
+        exit(4);
+    }
+    epoll_watch(sv->epollFd, sv->childFd, EV_CHILD, 0);
+    if (pipe2(reloadPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("event loop");
+        exit(4);
+    }
+    epoll_watch(sv->epollFd, reloadPipe[READ_END], EV_RELOAD, 0);
+    sv->pidMap.capacity = sv->pidMap.used = 0;
+    sv->pidMap.pids = NULL;
+    sv->pidMap.ids = NULL;
+
+    // stdin is read through our own buffer rather than stdio, so epoll
+    // readiness reflects every byte that has not been buffered yet. A
+    // regular file is mapped instead, unless it is to be spliced.
+    sv->inputMapped = !sv->args.opts.spliceFanout && map_input(sv);
+    if (!sv->inputMapped) {
+        reader_init(&sv->input, INPUT_BUFFER_SIZE);
+    }
+    sv->inputPending = false;
+    sv->inputRing = NULL;
+    sv->inputFd = STDIN_FILENO;
+    start_collectors(sv);
+    if (sv->args.opts.threaded && !sv->args.opts.spliceFanout
+            && !sv->inputMapped) {
+        // Spliced input never passes through the supervisor, so it is
+        // always read by the event loop
+        sv->inputRing = malloc(sizeof(ByteRing));
+        byte_ring_init(sv->inputRing, INPUT_RING_SIZE, true);
+        start_thread(&sv->inputThread, input_thread, sv->inputRing);
+        // Never joined: at exit it may still be blocked reading stdin
+        pthread_detach(sv->inputThread);
+        sv->inputFd = sv->inputRing->dataFd;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_TAG(EV_STDIN, 0);
+    sv->stdinPollable = true;
+    sv->inputWatched = true;
+    if (epoll_ctl(sv->epollFd, EPOLL_CTL_ADD, sv->inputFd, &ev) == -1) {
+        // Regular files (e.g. -i inputfile) are always readable
+        sv->stdinPollable = false;
+    }
+    sv->controlFd = -1;
+    if (sv->args.opts.controlPath != NULL) {
+        setup_control_socket(sv);
+    }
+}
+
+/* void start_job(Supervisor *sv, int i)
+* -----------------------------------------------
+* Spawns a process for a job and hooks its stdout pipe into the event loop.
+* A job reading another job's output is linked to it first; if it cannot be,
+* the job is reported as failing to start.
+*
+* args: sv - the supervisor state, i - the job ID
+*/
+void start_job(Supervisor *sv, int i) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    bool linked = job->inputPath[0] != '@' || job->linkFd >= 0
+            || link_job(sv, i);
+    if (job->downstream > 0 && job->jobOutput == -2
+            && job->outputPath[0] == '\0') {
+        // Its reader's link outlived the job's earlier file or run
+        job->jobOutput = jobs->props[job->downstream].linkFd;
+        jobs->states[i] &= ~JOB_PIPE_OUT;
+    }
+    // Framing applies to the job's input whatever its output goes to
+    job->frame = job->opts.frame;
+    if (linked) {
+        jobs->pids[i] = spawn_child(job, &jobs->inFds[i], &jobs->outFds[i]);
+    } else {
+        jobs->pids[i] = -1;
+        jobs->inFds[i] = jobs->outFds[i] = -1;
+    }
+    if (jobs->pids[i] > 0) {
+        pidmap_insert(&sv->pidMap, jobs->pids[i], i);
+    } else {
+        // Reported from the event loop, as a forked child that failed to
+        // exec would have been
+        if (sv->failedCount == sv->failedCap) {
+            sv->failedCap = sv->failedCap ? sv->failedCap * 2 : 8;
+            sv->failedSpawns = realloc(sv->failedSpawns,
+                    sizeof(int) * sv->failedCap);
+        }
+        sv->failedSpawns[sv->failedCount++] = i;
+    }
+    if (jobs->outFds[i] >= 0 && sv->collectorCount > 0) {
+        job->outBuf.start = job->outBuf.end = 0;
+        job->outTag++;
+        collector_command(&sv->collectors[i % sv->collectorCount], i,
+                job->outTag, jobs->outFds[i]);
+    } else if (jobs->outFds[i] >= 0) {
+        job->outBuf.start = job->outBuf.end = 0;
+        epoll_watch(sv->epollFd, jobs->outFds[i], EV_JOB_OUT, i);
+    }
+    jobs->runs[i]++;
+    job->startedAt = now_ms();
+    if (job->opts.idleMs > 0 && jobs->pids[i] > 0) {
+        job->lastOutputAt = job->startedAt;
+        arm_watchdog(sv, i);
+    }
+}
+
+/* void close_job_pipes(Supervisor *sv, int i)
+* -----------------------------------------------
+* Closes whichever ends of a job's pipes are still open on the supervisor side
+* and discards any input still queued for it
+*
+* args: sv - the supervisor state, i - the job whose pipes are to be closed
+*/
+void close_job_pipes(Supervisor *sv, int i) {
+    JobTable *jobs = &sv->jobs;
+    queue_clear(sv, i);
+    jobs->props[i].writeWatched = false;
+    if (jobs->inFds[i] >= 0) {
+        close(jobs->inFds[i]);
+        jobs->inFds[i] = -1;
+    }
+    close_job_output(sv, i);
+}
+
+/* void handle_signals(Supervisor *sv)
+* -----------------------------------------------
+* Handles the signals delivered through the signalfd: SIGCHLD reaps the
+* children that exited, SIGUSR1 writes the metrics
+*
+* args: sv - the supervisor state
+*/
+void handle_signals(Supervisor *sv) {
+    struct signalfd_siginfo info;
+    bool childExited = false;
+    bool metricsWanted = false;
+    while (read(sv->childFd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            metricsWanted = true;
+        } else {
+            childExited = true;
+        }
+    }
+    if (metricsWanted) {
+        write_metrics(sv);
+    }
+    // Once the input is exhausted, jobs are not reported or restarted any
+    // more
+    if (childExited && !sv->draining) {
+        reap_jobs(sv);
+        check_viable_workers(sv);
+    }
+}
+
+/* void reap_jobs(Supervisor *sv)
+* -----------------------------------------------
+* Collects the exit status of every child that has terminated since the last
+* SIGCHLD and hands it to the job it belongs to. If an output collector still
+* reads the job's stdout, the exit is reported once the collector reaches
+* EOF, or after COLLECT_EXIT_MS if it does not.
+*
+* args: sv - the supervisor state
+*/
+void reap_jobs(Supervisor *sv) {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int i = pidmap_remove(&sv->pidMap, pid);
+        if (i > 0 && sv->collectorCount > 0 && sv->jobs.outFds[i] >= 0) {
+            // Its output is reported first, once its collector reaches EOF
+            JobProps *job = &sv->jobs.props[i];
+            job->exitStatus = status;
+            job->exitAt = now_ms() + COLLECT_EXIT_MS;
+            schedule_timer(sv, job->exitAt, TIMER_EXIT, i);
+        } else if (i > 0) {
+            handle_job_exit(sv, i, status);
+        }
+    }
+}
+
+/* void reap_failed_spawns(Supervisor *sv)
+* -----------------------------------------------
+* Reports jobs whose command could not be executed as having exited with code
+* 99, going through the same restart accounting as any other exit
+*
+* args: sv - the supervisor state
+*/
+void reap_failed_spawns(Supervisor *sv) {
+    int count = sv->failedCount;
+    int failed[count];
+    memcpy(failed, sv->failedSpawns, sizeof(int) * count);
+    // Jobs restarted below may fail again; they are handled on the next pass
+    sv->failedCount = 0;
+    for (int k = 0; k < count; k++) {
+        handle_job_exit(sv, failed[k], 99 << 8);
+    }
+}
 
-// Global variable for signal handling
-// signals [0][0] = jobCount, [0][1] = SIGHUP
-// signals [i][0] = jobnum, [i][1] = numrestarts, [i][2] = linesto, 
-//    where i > 0, i = job ID
-int signals[100][3];
+/* void handle_job_exit(Supervisor *sv, int i, int status)
+* -----------------------------------------------
+* Reports the termination of a job and respawns it if its restart count
+* allows it
+*
+* args: sv - the supervisor state, i - the job ID, status - the wait status
+*/
+void handle_job_exit(Supervisor *sv, int i, int status) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    job->status = status;
+    // Report whatever the job wrote before exiting first. A collector has
+    // reached the EOF of its pipe already, or was given up on.
+    if (sv->collectorCount == 0) {
+        read_job_output(sv, i);
+    }
+    if (WIFEXITED(job->status)) {
+        printf("Job %d has terminated with exit code %d\n", i,
+                WEXITSTATUS(job->status));
+        job->metrics.exits++;
+        job->metrics.lastExit = WEXITSTATUS(job->status);
+    } else if (WIFSIGNALED(job->status)) {
+        printf("Job %d has terminated due to signal %d\n", i,
+                WTERMSIG(job->status));
+        job->metrics.signals++;
+        job->metrics.lastSignal = WTERMSIG(job->status);
+    }
+    end_console_line(sv);
+    job->metrics.awaitingSince = 0;
+    job->inFlight = 0;
+    sv->viableWorkers--;
+    jobs->states[i] |= JOB_ENDED;
+    jobs->states[i] &= ~JOB_PAUSED;
+    job->watchdogAt = job->killAt = 0;
+    bool restartRequested = job->restartRequested;
+    job->restartRequested = false;
+    close_job_pipes(sv, i);
+    if (job->stopAt != 0) {
+        job->stopAt = 0;
+        sv->pendingStops--;
+    }
+    if (job->replacing) {
+        // Its specification changed on reload: start afresh with the new one
+        job->replacing = false;
+        jobs->states[i] |= JOB_RUNNABLE;
+        jobs->runs[i] = 0;
+        job->crashStreak = 0;
+        restart_job(sv, i);
+    } else if (!(jobs->states[i] & JOB_RUNNABLE)) {
+        // Removed by a reload, or put on standby
+    } else if (restartRequested) {
+        job->crashStreak = 0;
+        restart_job(sv, i);
+    } else if ((jobs->runs[i] < job->restartCount)
+            || job->infiniteRestart == true) {
+        long long now = now_ms();
+        long long delay = restart_delay(sv, job, now - job->startedAt);
+        if (delay < 0) {
+            fprintf(stderr, "Job %d is crash looping, not restarting it\n",
+                    i);
+            jobs->states[i] &= ~JOB_RUNNABLE;
+        } else if (delay > 0) {
+            job->restartAt = now + delay;
+            sv->pendingRestarts++;
+            schedule_timer(sv, job->restartAt, TIMER_RESTART, i);
+        } else {
+            restart_job(sv, i);
+        }
+    } else if ((jobs->runs[i] > job->restartCount)
+            && (job->infiniteRestart == false)) {
+        jobs->states[i] &= ~JOB_RUNNABLE;
+    }
+    if (serves_requests(sv, i)) {
+        lose_requests(sv, i, !(jobs->states[i] & JOB_RUNNABLE));
+    }
+}
+
+/* void restart_job(Supervisor *sv, int i)
+* -----------------------------------------------
+* Starts a new run of a job that has ended, replaying whatever input the last
+* run left unanswered
+*
+* args: sv - the supervisor state, i - the job ID
+*/
+void restart_job(Supervisor *sv, int i) {
+    start_job(sv, i);
+    sv->viableWorkers++;
+    sv->jobs.states[i] &= ~JOB_ENDED;
+    if (sv->args.verboseFlag) {
+        fprintf(stderr, "Restarting worker %d\n", i);
+    }
+    if (sv->jobs.inFds[i] >= 0) {
+        replay_lines(sv, i);
+    }
+    int g = sv->jobs.props[i].group;
+    if (g >= 0 && sv->groups[g].shared) {
+        feed_group(sv, g);
+    }
+}
+
+/* long long restart_delay(Supervisor *sv, JobProps *job, long long ranFor)
+* -----------------------------------------------
+* Works out how long to wait before restarting a job that has exited. A run
+* shorter than the stability window extends the job's crash streak and a
+* longer one ends it. The first quick exit is restarted at once; after that
+* the delay doubles with every quick exit in a row, up to the maximum, with
+* random jitter so that jobs failing together do not restart in lockstep.
+*
+* args: sv - the supervisor state, job - the job, ranFor - the length of the
+*     run that just ended in ms
+* Returns: the delay in ms, or -1 if the job should be parked
+*/
+long long restart_delay(Supervisor *sv, JobProps *job, long long ranFor) {
+    Options *opts = &sv->args.opts;
+    if (ranFor >= opts->stableMs) {
+        job->crashStreak = 0;
+        return 0;
+    }
+    job->crashStreak++;
+    if (opts->crashLoop > 0 && job->crashStreak >= opts->crashLoop) {
+        return -1;
+    }
+    if (job->crashStreak < 2) {
+        return 0;
+    }
+    long long delay = opts->backoffMs;
+    for (int k = 2; k < job->crashStreak && delay < opts->backoffMaxMs; k++) {
+        delay *= 2;
+    }
+    if (delay > opts->backoffMaxMs) {
+        delay = opts->backoffMaxMs;
+    }
+    // Equal jitter: between half and all of the computed delay
+    if (delay > 1) {
+        delay = delay / 2 + random() % (delay - delay / 2 + 1);
+    }
+    return delay;
+}
+
+/* void schedule_timer(Supervisor *sv, long long due, TimerKind kind,
+        int id)
+* -----------------------------------------------
+* Adds a timer to the supervisor's timer heap
+*
+* args: sv - the supervisor state, due - CLOCK_MONOTONIC time in ms at which
+*     the timer falls due, kind - what the timer does, id - the job ID it
+*     applies to (0 if none)
+*/
+void schedule_timer(Supervisor *sv, long long due, TimerKind kind, int id) {
+    TimerHeap *heap = &sv->timers;
+    if (heap->count == heap->cap) {
+        heap->cap = heap->cap ? heap->cap * 2 : TIMER_HEAP_MIN_CAPACITY;
+        heap->items = realloc(heap->items, sizeof(Timer) * heap->cap);
+    }
+    // Sift the new timer up from the last leaf
+    int k = heap->count++;
+    while (k > 0 && heap->items[(k - 1) / 2].due > due) {
+        heap->items[k] = heap->items[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    heap->items[k].due = due;
+    heap->items[k].kind = kind;
+    heap->items[k].id = id;
+}
+
+/* void timer_pop(TimerHeap *heap)
+* -----------------------------------------------
+* Removes the earliest timer from a timer heap
+*
+* args: heap - the heap (must not be empty)
+*/
+void timer_pop(TimerHeap *heap) {
+    Timer last = heap->items[--heap->count];
+    // Sift the last timer down from the root
+    int k = 0;
+    while (2 * k + 1 < heap->count) {
+        int child = 2 * k + 1;
+        if (child + 1 < heap->count
+                && heap->items[child + 1].due < heap->items[child].due) {
+            child++;
+        }
+        if (heap->items[child].due >= last.due) {
+            break;
+        }
+        heap->items[k] = heap->items[child];
+        k = child;
+    }
+    heap->items[k] = last;
+}
+
+/* void run_due_timers(Supervisor *sv)
+* -----------------------------------------------
+* Fires every timer that has fallen due: restarts jobs whose restart delay
+* has passed, sends SIGTERM to jobs stopped by a reload that have not exited
+* in time, resumes the main input after a *sleep, checks watchdogs, sends
+* SIGKILL to hung jobs that ignored SIGTERM and resizes groups to their load.
+* Timers whose job was
+* restarted, stopped, rescheduled or has exited in the meantime are
+* discarded.
+*
+* args: sv - the supervisor state
+*/
+void run_due_timers(Supervisor *sv) {
+    long long now = now_ms();
+    TimerHeap *heap = &sv->timers;
+    while (heap->count > 0 && heap->items[0].due <= now) {
+        Timer timer = heap->items[0];
+        timer_pop(heap);
+        JobProps *job = &sv->jobs.props[timer.id];
+        if (timer.kind == TIMER_RESTART && job->restartAt == timer.due) {
+            job->restartAt = 0;
+            sv->pendingRestarts--;
+            restart_job(sv, timer.id);
+        } else if (timer.kind == TIMER_STOP && job->stopAt == timer.due) {
+            job->stopAt = 0;
+            sv->pendingStops--;
+            kill(sv->jobs.pids[timer.id], SIGTERM);
+        } else if (timer.kind == TIMER_INPUT && sv->sleepUntil == timer.due) {
+            sv->sleepUntil = 0;
+        } else if (timer.kind == TIMER_WATCHDOG
+                && job->watchdogAt == timer.due) {
+            job->watchdogAt = 0;
+            check_watchdog(sv, timer.id);
+        } else if (timer.kind == TIMER_KILL && job->killAt == timer.due) {
+            job->killAt = 0;
+            kill(sv->jobs.pids[timer.id], SIGKILL);
+        } else if (timer.kind == TIMER_SCALE && sv->scaleAt == timer.due) {
+            sv->scaleAt = 0;
+            autoscale(sv);
+        } else if (timer.kind == TIMER_EXIT && job->exitAt == timer.due) {
+            // Something else holds its stdout open; report the exit anyway
+            job->exitAt = 0;
+            handle_job_exit(sv, timer.id, job->exitStatus);
+            check_viable_workers(sv);
+        }
+    }
+}
+
+/* void autoscale(Supervisor *sv)
+* -----------------------------------------------
+* Resizes every group with a replica range (replicas=MIN-MAX) to its load and
+* checks again after SCALE_INTERVAL_MS. A group grows to one active member
+* per scale-up unanswered lines, and by one member if its oldest unanswered
+* line has waited for scale-latency ms. It shrinks by one member for every
+* scale-idle ms it goes without unanswered lines, down to its minimum.
+*
+* args: sv - the supervisor state
+*/
+void autoscale(Supervisor *sv) {
+    Options *opts = &sv->args.opts;
+    long long now = now_ms();
+    bool ranged = false;
+    for (int g = 0; g < sv->groupCount; g++) {
+        JobGroup *group = &sv->groups[g];
+        if (group->scaleMin >= group->scaleMax) {
+            continue;
+        }
+        ranged = true;
+        long backlog = group->queue.count;
+        long long oldest = 0;
+        for (int m = 0; m < group->memberCount; m++) {
+            int j = group->members[m];
+            long long since = sv->jobs.props[j].metrics.awaitingSince;
+            if (sv->jobs.states[j] & JOB_RUNNABLE) {
+                backlog += member_load(sv, j);
+            }
+            if (since != 0 && (oldest == 0 || since < oldest)) {
+                oldest = since;
+            }
+        }
+        int active = active_members(sv, group);
+        int wanted = active;
+        if (backlog > (long) opts->scaleUp * active) {
+            wanted = (backlog + opts->scaleUp - 1) / opts->scaleUp;
+        } else if (opts->scaleLatencyMs > 0 && oldest != 0
+                && now_us() - oldest >= opts->scaleLatencyMs * 1000LL) {
+            wanted = active + 1;
+        }
+        if (backlog > 0) {
+            group->idleSince = 0;
+        } else if (group->idleSince == 0) {
+            group->idleSince = now;
+        } else if (now - group->idleSince >= opts->scaleIdleMs) {
+            wanted = active - 1;
+            group->idleSince = now;
+        }
+        wanted = (wanted < group->scaleMin) ? group->scaleMin
+                : (wanted > group->scaleMax) ? group->scaleMax : wanted;
+        if (wanted != active) {
+            scale_group(sv, g, wanted);
+        }
+    }
+    if (ranged) {
+        sv->scaleAt = now + SCALE_INTERVAL_MS;
+        schedule_timer(sv, sv->scaleAt, TIMER_SCALE, 0);
+    }
+}
+
+/* int scale_group(Supervisor *sv, int g, int wanted)
+* -----------------------------------------------
+* Starts members of a group that are on standby, or puts active ones on
+* standby, until the wanted number is active. Members are started in order
+* and put on standby newest first; one put on standby is stopped the way a
+* job removed by a reload is, so it still answers what was queued for it.
+*
+* args: sv - the supervisor state, g - the index of the group, wanted - the
+*     number of members to keep active
+* Returns: the number of active members afterwards
+*/
+int scale_group(Supervisor *sv, int g, int wanted) {
+    JobGroup *group = &sv->groups[g];
+    JobTable *jobs = &sv->jobs;
+    int before = active_members(sv, group);
+    int active = before;
+    for (int m = 0; m < group->memberCount && active < wanted; m++) {
+        int j = group->members[m];
+        bool exited = jobs->runs[j] == 0 || (jobs->states[j] & JOB_ENDED);
+        if ((jobs->states[j] & JOB_STANDBY) && exited) {
+            jobs->states[j] &= ~JOB_STANDBY;
+            jobs->states[j] |= JOB_RUNNABLE;
+            jobs->runs[j] = 0;
+            jobs->props[j].crashStreak = 0;
+            restart_job(sv, j);
+            active++;
+        }
+    }
+    for (int m = group->memberCount - 1; m >= 0 && active > wanted; m--) {
+        int j = group->members[m];
+        JobProps *job = &jobs->props[j];
+        if (!(jobs->states[j] & JOB_RUNNABLE)) {
+            continue;
+        }
+        if (job->restartAt != 0) {
+            job->restartAt = 0;
+            sv->pendingRestarts--;
+        }
+        stop_job(sv, j);
+        jobs->states[j] |= JOB_STANDBY;
+        active--;
+    }
+    if (active != before && sv->args.verboseFlag) {
+        fprintf(stderr, "Scaling group %s from %d to %d workers\n",
+                group->name ? group->name : "-", before, active);
+    }
+    return active;
+}
+
+/* int active_members(Supervisor *sv, JobGroup *group)
+* -----------------------------------------------
+* Counts the members of a group that are running or about to be restarted
+*
+* args: sv - the supervisor state, group - the group
+* Returns: the number of members that are neither on standby, parked nor
+*     removed
+*/
+int active_members(Supervisor *sv, JobGroup *group) {
+    int active = 0;
+    for (int m = 0; m < group->memberCount; m++) {
+        if (sv->jobs.states[group->members[m]] & JOB_RUNNABLE) {
+            active++;
+        }
+    }
+    return active;
+}
+
+/* int next_timeout(Supervisor *sv)
+* -----------------------------------------------
+* Works out how long the event loop may wait for events before the earliest
+* timer falls due
+*
+* args: sv - the supervisor state
+* Returns: the time to wait in ms, or -1 if no timer is pending
+*/
+int next_timeout(Supervisor *sv) {
+    if (sv->timers.count == 0) {
+        return -1;
+    }
+    long long wait = sv->timers.items[0].due - now_ms();
+    return (wait > 0) ? (int) wait : 0;
+}
+
+/* void arm_watchdog(Supervisor *sv, int i)
+* -----------------------------------------------
+* Schedules the next check of a running job's response deadline and idle
+* timeout, unless an earlier check is already scheduled (it re-arms the
+* watchdog when it finds nothing wrong)
+*
+* args: sv - the supervisor state, i - the job ID
+*/
+void arm_watchdog(Supervisor *sv, int i) {
+    JobProps *job = &sv->jobs.props[i];
+    long long due = 0;
+    if (job->opts.deadlineMs > 0 && job->metrics.awaitingSince != 0) {
+        due = job->metrics.awaitingSince / 1000 + job->opts.deadlineMs;
+    }
+    if (job->opts.idleMs > 0) {
+        long long idleDue = job->lastOutputAt + job->opts.idleMs;
+        due = (due == 0 || idleDue < due) ? idleDue : due;
+    }
+    if (due == 0 || (job->watchdogAt != 0 && job->watchdogAt <= due)) {
+        return;
+    }
+    job->watchdogAt = due;
+    schedule_timer(sv, due, TIMER_WATCHDOG, i);
+}
+
+/* void check_watchdog(Supervisor *sv, int i)
+* -----------------------------------------------
+* Terminates a job that has gone deadlineMs without answering a line or
+* idleMs without any output, and otherwise schedules the next check. Jobs
+* that are already on their way out are left alone, and a paused job's
+* watchdog waits until it is resumed.
+*
+* args: sv - the supervisor state, i - the job ID
+*/
+void check_watchdog(Supervisor *sv, int i) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    if (jobs->runs[i] == 0 || (jobs->states[i] & JOB_ENDED)
+            || job->stopAt != 0 || job->replacing || job->restartRequested
+            || job->killAt != 0 || (jobs->states[i] & JOB_PAUSED)) {
+        return;
+    }
+    if (job->opts.deadlineMs > 0 && job->metrics.awaitingSince != 0
+            && now_us() - job->metrics.awaitingSince
+            >= job->opts.deadlineMs * 1000LL) {
+        terminate_hung_job(sv, i, "missed its response deadline");
+    } else if (job->opts.idleMs > 0
+            && now_ms() - job->lastOutputAt >= job->opts.idleMs) {
+        terminate_hung_job(sv, i, "has been idle for too long");
+    } else {
+        arm_watchdog(sv, i);
+    }
+}
+
+/* void terminate_hung_job(Supervisor *sv, int i, const char *reason)
+* -----------------------------------------------
+* Sends SIGTERM to a job its watchdog found hung, and SIGKILL if it has not
+* exited WATCHDOG_KILL_MS later. Its exit goes through the usual restart
+* accounting.
+*
+* args: sv - the supervisor state, i - the job ID, reason - what the job did
+*     wrong, for the message
+*/
+void terminate_hung_job(Supervisor *sv, int i, const char *reason) {
+    JobProps *job = &sv->jobs.props[i];
+    fprintf(stderr, "Job %d %s, terminating it\n", i, reason);
+    job->metrics.timeouts++;
+    kill(sv->jobs.pids[i], SIGTERM);
+    job->killAt = now_ms() + WATCHDOG_KILL_MS;
+    schedule_timer(sv, job->killAt, TIMER_KILL, i);
+}
+
+/* size_t pidmap_slot(PidMap *map, pid_t pid)
+* -----------------------------------------------
+* Finds the slot holding a pid, or the empty slot where it would be inserted
+*
+* args: map - the pid map (capacity must be non-zero), pid - the key
+* Returns: the index of the slot
+*/
+size_t pidmap_slot(PidMap *map, pid_t pid) {
+    size_t mask = map->capacity - 1;
+    size_t slot = ((size_t) pid * 2654435761u) & mask;
+    while (map->pids[slot] != 0 && map->pids[slot] != pid) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/* void pidmap_insert(PidMap *map, pid_t pid, int id)
+* -----------------------------------------------
+* Records the job ID of a newly spawned process, growing the table as needed
+*
+* args: map - the pid map, pid - the process ID, id - the job ID
+*/
+void pidmap_insert(PidMap *map, pid_t pid, int id) {
+    if ((map->used + 1) * 2 > map->capacity) {
+        PidMap old = *map;
+        map->capacity = old.capacity ? old.capacity * 2 : PIDMAP_MIN_CAPACITY;
+        map->pids = calloc(map->capacity, sizeof(pid_t));
+        map->ids = calloc(map->capacity, sizeof(int));
+        map->used = 0;
+        for (size_t k = 0; k < old.capacity; k++) {
+            if (old.pids[k] > 0) {
+                size_t slot = pidmap_slot(map, old.pids[k]);
+                map->pids[slot] = old.pids[k];
+                map->ids[slot] = old.ids[k];
+                map->used++;
+            }
+        }
+        free(old.pids);
+        free(old.ids);
+    }
+    size_t slot = pidmap_slot(map, pid);
+    if (map->pids[slot] == 0) {
+        map->used++;
+    }
+    map->pids[slot] = pid;
+    map->ids[slot] = id;
+}
+
+/* int pidmap_remove(PidMap *map, pid_t pid)
+* -----------------------------------------------
+* Removes a process that has been reaped from the map
+*
+* args: map - the pid map, pid - the process ID
+* Returns: the job ID the process belonged to, or 0 if it is not a job
+*/
+int pidmap_remove(PidMap *map, pid_t pid) {
+    if (map->capacity == 0) {
+        return 0;
+    }
+    size_t slot = pidmap_slot(map, pid);
+    if (map->pids[slot] != pid) {
+        return 0;
+    }
+    // Leave a tombstone so that probe chains through this slot stay intact
+    map->pids[slot] = -1;
+    return map->ids[slot];
+}
+
+/* void record_latency(JobMetrics *metrics, long long value)
+* -----------------------------------------------
+* Adds an input-to-first-output latency to a job's histogram
+*
+* args: metrics - the job's counters, value - the latency in microseconds
+*/
+void record_latency(JobMetrics *metrics, long long value) {
+    if (metrics->latency == NULL) {
+        metrics->latency = calloc(1, sizeof(Histogram));
+    }
+    Histogram *hist = metrics->latency;
+    uint64_t sample = (value > 0) ? value : 0;
+    hist->counts[hist_bucket(sample)]++;
+    hist->count++;
+    hist->sum += sample;
+    if (sample > hist->max) {
+        hist->max = sample;
+    }
+}
+
+/* int hist_bucket(uint64_t value)
+* -----------------------------------------------
+* Finds the histogram bucket a value falls into
+*
+* args: value - the value
+* Returns: the index of the bucket
+*/
+int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS
+            + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return (bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1;
+}
+
+/* uint64_t hist_bucket_start(int bucket)
+* -----------------------------------------------
+* Finds the smallest value that falls into a histogram bucket
+*
+* args: bucket - the index of the bucket
+* Returns: the lower bound of the bucket
+*/
+uint64_t hist_bucket_start(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int power = bucket / HIST_SUB_BUCKETS;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub) << (power - 1);
+}
+
+/* uint64_t hist_percentile(Histogram *hist, double percentile)
+* -----------------------------------------------
+* Estimates a percentile of the values in a histogram
+*
+* args: hist - the histogram (must not be empty), percentile - between 0 and
+*     100
+* Returns: the upper bound of the bucket holding the percentile, capped at
+*     the largest value recorded
+*/
+uint64_t hist_percentile(Histogram *hist, double percentile) {
+    uint64_t rank = (uint64_t) (hist->count * percentile / 100.0);
+    if (rank >= hist->count) {
+        rank = hist->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen > rank) {
+            uint64_t end = (b + 1 < HIST_BUCKETS)
+                    ? hist_bucket_start(b + 1) - 1 : hist->max;
+            return (end < hist->max) ? end : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* void write_metrics(Supervisor *sv)
+* -----------------------------------------------
+* Writes the supervisor's and every job's counters as a single JSON object,
+* to stderr or to the file given with -o metrics=PATH. A file is written
+* under a temporary name and renamed into place, so readers never see a
+* partial report.
+*
+* args: sv - the supervisor state
+*/
+void write_metrics(Supervisor *sv) {
+    const char *path = sv->args.opts.metricsPath;
+    char *tmpPath = NULL;
+    FILE *out = stderr;
+    if (path != NULL) {
+        tmpPath = malloc(strlen(path) + 5);
+        sprintf(tmpPath, "%s.tmp", path);
+        int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IWUSR | S_IRUSR);
+        if (fd == -1 || (out = fdopen(fd, "w")) == NULL) {
+            fprintf(stderr, "Error: unable to open \"%s\" for writing\n",
+                    tmpPath);
+            if (fd != -1) {
+                close(fd);
+            }
+            free(tmpPath);
+            return;
+        }
+    }
+    write_metrics_json(sv, out);
+    fputc('\n', out);
+    if (path != NULL) {
+        fclose(out);
+        if (rename(tmpPath, path) == -1) {
+            perror("metrics");
+        }
+        free(tmpPath);
+    } else {
+        fflush(out);
+    }
+}
+
+/* void write_metrics_json(Supervisor *sv, FILE *out)
+* -----------------------------------------------
+* Writes the supervisor's and every job's counters as a single JSON object,
+* without a trailing newline
+*
+* args: sv - the supervisor state, out - where to write
+*/
+void write_metrics_json(Supervisor *sv, FILE *out) {
+    long long now = now_ms();
+    fprintf(out, "{\"uptime_ms\":%lld,\"lines_read\":%llu,\"jobs\":%d,"
+            "\"viable\":%d,\"pending_restarts\":%d,\"input_paused\":%s,"
+            "\"job_metrics\":[", now - sv->startedAt, sv->linesRead,
+            sv->jobs.count, sv->viableWorkers, sv->pendingRestarts,
+            sv->inputPaused ? "true" : "false");
+    for (int i = 1; i <= sv->jobs.count; i++) {
+        if (i > 1) {
+            fputc(',', out);
+        }
+        write_job_metrics(sv, out, i, now);
+    }
+    fputs("],\"groups\":[", out);
+    for (int g = 0; g < sv->groupCount; g++) {
+        if (g > 0) {
+            fputc(',', out);
+        }
+        write_group_metrics(sv, out, g);
+    }
+    fputs("]}", out);
+}
+
+/* void write_group_metrics(Supervisor *sv, FILE *out, int g)
+* -----------------------------------------------
+* Writes the size of one dispatch group as a JSON object
+*
+* args: sv - the supervisor state, out - where to write, g - the index of the
+*     group
+*/
+void write_group_metrics(Supervisor *sv, FILE *out, int g) {
+    JobGroup *group = &sv->groups[g];
+    fputs("{\"name\":", out);
+    if (group->name != NULL) {
+        write_json_string(out, group->name);
+    } else {
+        fputs("null", out);
+    }
+    fprintf(out, ",\"members\":%d,\"active\":%d,\"min\":%d,\"max\":%d,"
+            "\"queue_depth\":%zu,\"dropped\":%llu}", group->memberCount,
+            active_members(sv, group), group->scaleMin, group->scaleMax,
+            group->queue.count, group->dropped);
+}
+
+/* void write_job_metrics(Supervisor *sv, FILE *out, int i, long long now)
+* -----------------------------------------------
+* Writes the counters of one job as a JSON object
+*
+* args: sv - the supervisor state, out - where to write, i - the job ID,
+*     now - the current CLOCK_MONOTONIC time in ms
+*/
+void write_job_metrics(Supervisor *sv, FILE *out, int i, long long now) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    JobMetrics *metrics = &job->metrics;
+    uint8_t state = jobs->states[i];
+    bool running = jobs->runs[i] > 0 && !(state & JOB_ENDED);
+    const char *status = running ? "running"
+            : (state & JOB_REMOVED) ? "removed"
+            : (state & JOB_STANDBY) ? "standby"
+            : (job->restartAt != 0) ? "backoff" : "stopped";
+    if (running && (job->stopAt != 0 || job->replacing
+            || job->restartRequested)) {
+        status = "stopping";
+    } else if (running && (state & JOB_PAUSED)) {
+        status = "paused";
+    }
+    fprintf(out, "{\"id\":%d,\"cmd\":", i);
+    write_json_string(out, job->jobCmd ? job->jobCmd : "");
+    fprintf(out, ",\"state\":\"%s\",\"pid\":%d,\"runs\":%d,\"restarts\":%d,"
+            "\"uptime_ms\":%lld,\"lines_in\":%llu,\"bytes_in\":%llu,"
+            "\"lines_out\":%d,\"bytes_out\":%llu,\"queue_depth\":%zu,"
+            "\"dropped\":%llu,\"exits\":%d,\"signals\":%d,\"last_exit\":%d,"
+            "\"last_signal\":%d,\"crash_streak\":%d,\"timeouts\":%d,"
+            "\"replayed\":%llu,\"replay_depth\":%zu", status,
+            running ? (int) jobs->pids[i] : 0, (int) jobs->runs[i],
+            (jobs->runs[i] > 0) ? (int) jobs->runs[i] - 1 : 0,
+            running ? now - job->startedAt : 0, metrics->linesIn,
+            metrics->bytesIn, jobs->linesfrom[i], metrics->bytesOut,
+            job->inQueue.count, metrics->dropped, metrics->exits,
+            metrics->signals, metrics->lastExit, metrics->lastSignal,
+            job->crashStreak, metrics->timeouts, metrics->replayed,
+            job->replay.count);
+    Histogram *hist = metrics->latency;
+    if (hist != NULL && hist->count > 0) {
+        fprintf(out, ",\"latency_us\":{\"count\":%llu,\"mean\":%llu,"
+                "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,"
+                "\"max\":%llu}", (unsigned long long) hist->count,
+                (unsigned long long) (hist->sum / hist->count),
+                (unsigned long long) hist_percentile(hist, 50),
+                (unsigned long long) hist_percentile(hist, 90),
+                (unsigned long long) hist_percentile(hist, 99),
+                (unsigned long long) hist_percentile(hist, 99.9),
+                (unsigned long long) hist->max);
+    }
+    fputc('}', out);
+}
+
+/* void write_json_string(FILE *out, const char *text)
+* -----------------------------------------------
+* Writes a string as a quoted JSON string
+*
+* args: out - where to write, text - the string
+*/
+void write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *) text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* void check_viable_workers(Supervisor *sv)
+* -----------------------------------------------
+* Exits the program once no job is left running
+*
+* args: sv - the supervisor state
+* Errors: exits with code 0 when there are no more viable workers
+*/
+void check_viable_workers(Supervisor *sv) {
+    if (sv->viableWorkers > 0 || sv->pendingRestarts > 0) {
+        return;
+    }
+    for (int j = 1; j <= sv->jobs.count; j++) {
+        if ((sv->jobs.states[j] & (JOB_RUNNABLE | JOB_ENDED)) == JOB_RUNNABLE) {
+            return;
+        }
+    }
+    release_all_requests(sv);
+    fflush(stdout);
+    fprintf(stderr, "No more viable workers, exiting\n");
+    fflush(stderr);
+    close_control_socket(sv);
+    jobtable_free(&sv->jobs);
+    arena_free(&sv->arena);
+    exit(0);
+}
+
+/* void read_job_output(Supervisor *sv, int j)
+* -----------------------------------------------
+* Drains what is currently available on a job's non-blocking stdout pipe into
+* its line buffer and reports every complete line. At most MAX_READ_PER_EVENT
+* bytes are read per call so that a chatty job cannot starve the others; the
+* rest is picked up on the next wakeup.
+*
+* args: sv - the supervisor state, j - the job ID
+*/
+void read_job_output(Supervisor *sv, int j) {
+    int *fd = &sv->jobs.outFds[j];
+    LineReader *reader = &sv->jobs.props[j].outBuf;
+    size_t total = 0;
+    while (*fd >= 0 && total < MAX_READ_PER_EVENT) {
+        ssize_t got = reader_fill(reader, *fd);
+        if (got > 0) {
+            total += got;
+            if (sv->jobs.props[j].opts.idleMs > 0) {
+                sv->jobs.props[j].lastOutputAt = now_ms();
+            }
+            emit_job_lines(sv, j, false);
+        } else if (got == 0) {
+            emit_job_lines(sv, j, true);
+            if (sv->args.verboseFlag) {
+                fprintf(stderr, "Received EOF from job %d\n", j);
+            }
+            close_job_output(sv, j);
+        } else {
+            break;
+        }
+    }
+}
+
+/* void emit_job_lines(Supervisor *sv, int j, bool atEof)
+* -----------------------------------------------
+* Reports every complete line (or record) held in a job's output buffer and
+* keeps any trailing partial line for the next read. If the job writes an
+* invalid record, its output pipe is closed.
+*
+* args: sv - the supervisor state, j - the job ID, atEof - true if the pipe
+*     has closed, in which case a trailing partial line is reported too
+*/
+void emit_job_lines(Supervisor *sv, int j, bool atEof) {
+    JobProps *job = &sv->jobs.props[j];
+    JobMetrics *metrics = &job->metrics;
+    LineView line;
+    int found;
+    bool requests = serves_requests(sv, j);
+    while ((found = record_next(&job->outBuf, &line, job->frame, atEof)) > 0) {
+        if (requests) {
+            answer_request(sv, j, &line);
+        } else {
+            report_output(sv, j, line.data, line.len);
+            replay_ack(&job->replay);
+        }
+        sv->jobs.linesfrom[j]++;
+        if (job->inFlight > 0) {
+            job->inFlight--;
+        }
+        metrics->bytesOut += line.len + 1;
+        if (metrics->awaitingSince != 0) {
+            record_latency(metrics, now_us() - metrics->awaitingSince);
+            metrics->awaitingSince = 0;
+        }
+    }
+    end_console_line(sv);
+    if (found < 0 || (atEof && job->outBuf.start != job->outBuf.end)) {
+        // Nothing after a malformed record can be trusted, so the rest of
+        // the job's output is discarded until it is restarted
+        fprintf(stderr, "Job %d wrote %s record, discarding its output\n",
+                j, (found < 0) ? "an invalid" : "an incomplete");
+        job->outBuf.start = job->outBuf.end;
+        if (!atEof) {
+            close_job_output(sv, j);
+            return;
+        }
+    }
+    // Replies open the window for more requests
+    if (requests && job->inQueue.count > 0 && !job->writeWatched) {
+        flush_job_queue(sv, j);
+    }
+    // Answers make room for more of a shared group's lines, unless the job
+    // is going away
+    if (job->group >= 0 && sv->groups[job->group].shared && !atEof) {
+        feed_group(sv, job->group);
+    }
+}
+
+/* void report_output(Supervisor *sv, int j, const char *data, size_t len)
+* -----------------------------------------------
+* Writes a line, record or reply of a job's output to stdout
+*
+* args: sv - the supervisor state, j - the job ID, data - the output, len -
+*     its length
+*/
+void report_output(Supervisor *sv, int j, const char *data, size_t len) {
+    if (sv->jobs.props[j].frame == FRAME_LINE) {
+        printf("%d->'%.*s'\n", j, (int) len, data);
+    } else {
+        // A record may hold newlines and null bytes
+        printf("%d->'", j);
+        fwrite(data, 1, len, stdout);
+        fputs("'\n", stdout);
+    }
+}
+
+/* void dispatch_line(Supervisor *sv, const char *text, size_t len)
+* -----------------------------------------------
+* Queues a line of input for every live job that reads from a pipe and is not
+* in a dispatch group, and for one member of each dispatch group, or for the
+* group itself if it is shared
+*
+* args: sv - the supervisor state, text - the line to send without its
+*     newline, len - the length of text
+*/
+void dispatch_line(Supervisor *sv, const char *text, size_t len) {
+    SharedLine *line = shared_line_new(text, len);
+    line->seq = sv->linesRead;
+    JobTable *jobs = &sv->jobs;
+    for (int j = 1; j <= jobs->count; j++) {
+        uint8_t state = jobs->states[j];
+        if ((state & (JOB_RUNNABLE | JOB_ENDED | JOB_GROUPED))
+                != JOB_RUNNABLE) {
+            continue;
+        }
+        if (state & JOB_PIPE_IN) {
+            enqueue_line(sv, j, line);
+        } else {
+            jobs->linesto[j] = 0;
+        }
+    }
+    for (int g = 0; g < sv->groupCount; g++) {
+        if (sv->groups[g].shared) {
+            group_enqueue(sv, g, line);
+            continue;
+        }
+        int j = pick_member(sv, &sv->groups[g], line);
+        if (j > 0) {
+            enqueue_line(sv, j, line);
+        } else if (sv->args.verboseFlag) {
+            fprintf(stderr, "No job available in group %d\n", g + 1);
+        }
+    }
+    shared_line_release(line);
+}
+
+/* void build_groups(Supervisor *sv)
+* -----------------------------------------------
+* Sorts the registered jobs into dispatch groups: jobs naming a group in the
+* jobfile join that group, and with -o dispatch=... every other job joins one
+* shared group. A group takes its policy, key field and replica range from
+* the options of its first member, falling back to rr and the commandline key
+* field.
+*
+* args: sv - the supervisor state
+*/
+void build_groups(Supervisor *sv) {
+    sv->groups = NULL;
+    sv->groupCount = 0;
+    for (int j = 1; j <= sv->jobs.count; j++) {
+        JobProps *job = &sv->jobs.props[j];
+        job->group = -1;
+        sv->jobs.states[j] &= ~JOB_GROUPED;
+        if ((job->opts.group == NULL
+                && sv->args.opts.dispatch == DISPATCH_BROADCAST)
+                || (sv->jobs.states[j] & JOB_REMOVED)) {
+            continue;
+        }
+        DispatchPolicy policy = (sv->args.opts.dispatch == DISPATCH_BROADCAST)
+                ? DISPATCH_RR : sv->args.opts.dispatch;
+        int g = find_group(sv, job->opts.group, policy,
+                sv->args.opts.keyField);
+        JobGroup *group = &sv->groups[g];
+        if (job->opts.hasDispatch && group->memberCount == 0) {
+            group->policy = job->opts.dispatch;
+        }
+        if (job->opts.hasKey && group->memberCount == 0) {
+            group->keyField = job->opts.keyField;
+        }
+        if (job->opts.replicaMax > 0 && group->memberCount == 0) {
+            group->scaleMin = job->opts.replicaMin;
+            group->scaleMax = job->opts.replicaMax;
+        }
+        group->members = realloc(group->members,
+                sizeof(int) * (group->memberCount + 1));
+        group->members[group->memberCount++] = j;
+        job->group = g;
+        sv->jobs.states[j] |= JOB_GROUPED;
+    }
+    for (int g = 0; g < sv->groupCount; g++) {
+        JobGroup *group = &sv->groups[g];
+        if (group->policy == DISPATCH_BROADCAST) {
+            // A broadcast group is no group at all
+            for (int m = 0; m < group->memberCount; m++) {
+                sv->jobs.props[group->members[m]].group = -1;
+                sv->jobs.states[group->members[m]] &= ~JOB_GROUPED;
+            }
+            group->memberCount = 0;
+        } else if (group->policy == DISPATCH_HASH) {
+            build_hash_ring(group);
+        }
+        if (group->scaleMax > group->memberCount) {
+            group->scaleMax = group->memberCount;
+        }
+        group->shared = group->scaleMax > 0
+                && group->policy != DISPATCH_HASH;
+        if (group->scaleMin < group->scaleMax && sv->scaleAt == 0) {
+            sv->scaleAt = now_ms() + SCALE_INTERVAL_MS;
+            schedule_timer(sv, sv->scaleAt, TIMER_SCALE, 0);
+        }
+    }
+    if (sv->groupCount > 0 && sv->args.opts.spliceFanout) {
+        fprintf(stderr, "Warning: dispatch groups are ignored with "
+                "fanout=splice\n");
+    }
+}
+
+/* int find_group(Supervisor *sv, const char *name, DispatchPolicy policy,
+        int keyField)
+* -----------------------------------------------
+* Looks up a dispatch group by name, creating it if it does not exist yet
+*
+* args: sv - the supervisor state, name - the group name (NULL for the
+*     commandline group), policy, keyField - the settings of a new group
+* Returns: the index of the group
+*/
+int find_group(Supervisor *sv, const char *name, DispatchPolicy policy,
+        int keyField) {
+    for (int g = 0; g < sv->groupCount; g++) {
+        if (same_group_name(name, sv->groups[g].name)) {
+            return g;
+        }
+    }
+    sv->groups = realloc(sv->groups, sizeof(JobGroup) * (sv->groupCount + 1));
+    JobGroup *group = &sv->groups[sv->groupCount];
+    memset(group, 0, sizeof(JobGroup));
+    group->name = name ? strdup(name) : NULL;
+    group->policy = policy;
+    group->keyField = keyField;
+    return sv->groupCount++;
+}
+
+/* bool same_group_name(const char *name, const char *other)
+* -----------------------------------------------
+* Compares two group names, either of which may be NULL for the commandline
+* group
+*
+* args: name, other - the names
+* Returns: true if they name the same group
+*/
+bool same_group_name(const char *name, const char *other) {
+    return (name == NULL && other == NULL)
+            || (name != NULL && other != NULL && !strcmp(name, other));
+}
+
+/* void build_hash_ring(JobGroup *group)
+* -----------------------------------------------
+* Places RING_VNODES points per member on the group's consistent hash ring,
+* so that a member leaving only moves the keys it owned
+*
+* args: group - the dispatch group
+*/
+void build_hash_ring(JobGroup *group) {
+    group->ringSize = group->memberCount * RING_VNODES;
+    uint64_t *points = malloc(sizeof(uint64_t) * group->ringSize);
+    for (int m = 0; m < group->memberCount; m++) {
+        for (int v = 0; v < RING_VNODES; v++) {
+            uint32_t hash = mix_hash(((uint32_t) group->members[m] << 8) ^ v);
+            points[m * RING_VNODES + v] = ((uint64_t) hash << 32) | m;
+        }
+    }
+    qsort(points, group->ringSize, sizeof(uint64_t), compare_ring_points);
+    group->ringHashes = malloc(sizeof(uint32_t) * group->ringSize);
+    group->ringMembers = malloc(sizeof(int) * group->ringSize);
+    for (int k = 0; k < group->ringSize; k++) {
+        group->ringHashes[k] = points[k] >> 32;
+        group->ringMembers[k] = group->members[points[k] & 0xFFFFFFFF];
+    }
+    free(points);
+}
+
+/* int compare_ring_points(const void *a, const void *b)
+* -----------------------------------------------
+* qsort comparator ordering hash ring points by hash
+*
+* args: a, b - pointers to the packed ring points
+* Returns: negative, zero or positive as a sorts before, with or after b
+*/
+int compare_ring_points(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    return (left > right) - (left < right);
+}
+
+/* uint32_t hash_bytes(const char *data, size_t len)
+* -----------------------------------------------
+* FNV-1a hash of a key
+*
+* args: data - the key, len - the length of the key
+* Returns: the 32 bit hash
+*/
+uint32_t hash_bytes(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t k = 0; k < len; k++) {
+        hash ^= (unsigned char) data[k];
+        hash *= 16777619u;
+    }
+    return mix_hash(hash);
+}
+
+/* uint32_t mix_hash(uint32_t value)
+* -----------------------------------------------
+* Scrambles the bits of a value (murmur3 finaliser) so that nearby values
+* spread evenly around the hash ring
+*
+* args: value - the value to scramble
+* Returns: the scrambled value
+*/
+uint32_t mix_hash(uint32_t value) {
+    value ^= value >> 16;
+    value *= 0x85ebca6bu;
+    value ^= value >> 13;
+    value *= 0xc2b2ae35u;
+    value ^= value >> 16;
+    return value;
+}
+
+/* bool can_dispatch(JobTable *jobs, int j)
+* -----------------------------------------------
+* Checks whether a job can be handed lines at the moment
+*
+* args: jobs - the job table, j - the job ID
+* Returns: true if the job is running, not paused and reads its input from a
+*     pipe
+*/
+bool can_dispatch(JobTable *jobs, int j) {
+    return (jobs->states[j] & (JOB_RUNNABLE | JOB_ENDED | JOB_PIPE_IN
+            | JOB_PAUSED)) == (JOB_RUNNABLE | JOB_PIPE_IN)
+            && jobs->inFds[j] >= 0;
+}
+
+/* int pick_member(Supervisor *sv, JobGroup *group, SharedLine *line)
+* -----------------------------------------------
+* Chooses the member of a dispatch group that gets a line
+*
+* args: sv - the supervisor state, group - the group, line - the line
+* Returns: the job ID of the chosen member, or 0 if no member is available
+*/
+int pick_member(Supervisor *sv, JobGroup *group, SharedLine *line) {
+    if (group->memberCount == 0) {
+        return 0;
+    }
+    if (group->policy == DISPATCH_HASH) {
+        return pick_by_hash(sv, group, line);
+    }
+    int best = 0;
+    long bestLoad = 0;
+    for (int k = 0; k < group->memberCount; k++) {
+        int m = (group->cursor + k) % group->memberCount;
+        int j = group->members[m];
+        if (!can_dispatch(&sv->jobs, j)) {
+            continue;
+        }
+        if (group->policy == DISPATCH_RR) {
+            group->cursor = (m + 1) % group->memberCount;
+            return group->members[m];
+        }
+        long load = member_load(sv, j);
+        if (best == 0 || load < bestLoad) {
+            best = m + 1;
+            bestLoad = load;
+        }
+    }
+    if (best == 0) {
+        return 0;
+    }
+    // Start the next search after the chosen member so ties rotate
+    group->cursor = best % group->memberCount;
+    return group->members[best - 1];
+}
+
+/* long member_load(Supervisor *sv, int j)
+* -----------------------------------------------
+* Works out how many lines the current run of a job has been sent but not
+* answered yet; a job writing to a file never answers, so only what is still
+* queued for it counts
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: the number of outstanding lines
+*/
+long member_load(Supervisor *sv, int j) {
+    return (sv->jobs.states[j] & JOB_PIPE_OUT)
+            ? (long) sv->jobs.props[j].inFlight
+            : (long) sv->jobs.props[j].inQueue.count;
+}
+
+/* void group_enqueue(Supervisor *sv, int g, SharedLine *line)
+* -----------------------------------------------
+* Queues a line for a shared group and hands out what its members can take.
+* Once the queue is full, input stops under slow=block; otherwise the oldest
+* line of the queue gives way.
+*
+* args: sv - the supervisor state, g - the index of the group, line - the
+*     line to send
+*/
+void group_enqueue(Supervisor *sv, int g, SharedLine *line) {
+    JobGroup *group = &sv->groups[g];
+    size_t limit = sv->args.opts.queueLimit;
+    if (group->queue.count >= limit) {
+        shared_line_release(queue_drop_oldest(&group->queue));
+        group->dropped++;
+        if (sv->args.verboseFlag) {
+            fprintf(stderr, "Dropped a line queued for group %s\n",
+                    group->name);
+        }
+        sv->fullQueues--;
+    }
+    queue_push(&group->queue, line);
+    if (group->queue.count == limit) {
+        sv->fullQueues++;
+    }
+    feed_group(sv, g);
+}
+
+/* void feed_group(Supervisor *sv, int g)
+* -----------------------------------------------
+* Hands the lines queued for a shared group, oldest first, to the members its
+* policy picks, as long as they have fewer lines unanswered than their
+* window. The rest wait for whichever member frees up first, including
+* members started when the group is scaled up. Once the input has ended and
+* the queue is empty, the members' stdin is closed.
+*
+* args: sv - the supervisor state, g - the index of the group
+*/
+void feed_group(Supervisor *sv, int g) {
+    JobGroup *group = &sv->groups[g];
+    OutQueue *queue = &group->queue;
+    size_t limit = sv->args.opts.queueLimit;
+    bool wasFull = queue->count >= limit;
+    // Only round robin may pick a member at its window and another not
+    int tries = (group->policy == DISPATCH_RR) ? group->memberCount : 1;
+    while (queue->count > 0) {
+        SharedLine *line = queue->lines[queue->head];
+        int j = 0;
+        for (int k = 0; k < tries && j == 0; k++) {
+            j = pick_member(sv, group, line);
+            if (j > 0 && member_load(sv, j) >= job_window(sv, j)) {
+                j = 0;
+            }
+        }
+        if (j == 0) {
+            break;
+        }
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->count--;
+        enqueue_line(sv, j, line);
+        shared_line_release(line);
+    }
+    if (wasFull && queue->count < limit) {
+        sv->fullQueues--;
+    }
+    if (sv->draining && queue->count == 0) {
+        for (int m = 0; m < group->memberCount; m++) {
+            if (sv->jobs.inFds[group->members[m]] >= 0) {
+                flush_job_queue(sv, group->members[m]);
+            }
+        }
+    }
+}
+
+/* bool group_pending(Supervisor *sv, int j)
+* -----------------------------------------------
+* Checks whether a job may still be handed lines by its group after the end
+* of the input
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: true if the job is a member of a shared group with lines queued
+*/
+bool group_pending(Supervisor *sv, int j) {
+    int g = sv->jobs.props[j].group;
+    return g >= 0 && sv->groups[g].queue.count > 0;
+}
+
+/* int pick_by_hash(Supervisor *sv, JobGroup *group, SharedLine *line)
+* -----------------------------------------------
+* Chooses the member that owns a line's key on the group's hash ring,
+* skipping members that are not available
+*
+* args: sv - the supervisor state, group - the group, line - the line
+* Returns: the job ID of the chosen member, or 0 if no member is available
+*/
+int pick_by_hash(Supervisor *sv, JobGroup *group, SharedLine *line) {
+    const char *key = line->data;
+    size_t keyLen = line->len - 1;
+    if (group->keyField > 0) {
+        // Find the requested space separated field
+        const char *end = line->data + line->len - 1;
+        int field = 1;
+        while (field < group->keyField && key < end) {
+            key = memchr(key, ' ', end - key);
+            key = key ? key + 1 : end;
+            field++;
+        }
+        const char *space = memchr(key, ' ', end - key);
+        keyLen = (space ? space : end) - key;
+    }
+    uint32_t hash = hash_bytes(key, keyLen);
+    int low = 0;
+    int high = group->ringSize;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (group->ringHashes[mid] < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int k = 0; k < group->ringSize; k++) {
+        int j = group->ringMembers[(low + k) % group->ringSize];
+        if (can_dispatch(&sv->jobs, j)) {
+            return j;
+        }
+    }
+    return 0;
+}
+
+/* SharedLine *shared_line_new(const char *text, size_t len)
+* -----------------------------------------------
+* Creates a shared line holding a copy of the text and a trailing newline
+*
+* args: text - the line without its newline, len - the length of text
+* Returns: the new line, holding one reference for the caller
+*/
+SharedLine *shared_line_new(const char *text, size_t len) {
+    SharedLine *line = shared_line_alloc(len + 1);
+    memcpy(line->data, text, len);
+    line->data[len] = '\n';
+    return line;
+}
+
+/* SharedLine *shared_line_alloc(size_t len)
+* -----------------------------------------------
+* Creates a shared line with room for len bytes of data, to be filled in by
+* the caller. Short lines are taken from the pool of released lines when it
+* is not empty.
+*
+* args: len - the number of bytes of data
+* Returns: the new line, holding one reference for the caller
+*/
+SharedLine *shared_line_alloc(size_t len) {
+    SharedLine *line;
+    if (len > POOLED_LINE_SIZE) {
+        line = malloc(sizeof(SharedLine) + len);
+    } else if (linePool != NULL) {
+        line = linePool;
+        linePool = line->next;
+        linePoolSize--;
+    } else {
+        // Allocated at full size so it can hold any short line once pooled
+        line = malloc(sizeof(SharedLine) + POOLED_LINE_SIZE);
+    }
+    line->refs = 1;
+    line->len = len;
+    line->seq = 0;
+    return line;
+}
+
+/* void shared_line_release(SharedLine *line)
+* -----------------------------------------------
+* Drops a reference to a shared line, pooling or freeing it when it is no
+* longer used
+*
+* args: line - the line to release
+*/
+void shared_line_release(SharedLine *line) {
+    if (--line->refs > 0) {
+        return;
+    }
+    if (line->len <= POOLED_LINE_SIZE && linePoolSize < LINE_POOL_MAX) {
+        line->next = linePool;
+        linePool = line;
+        linePoolSize++;
+    } else {
+        free(line);
+    }
+}
+
+/* void queue_push(OutQueue *queue, SharedLine *line)
+* -----------------------------------------------
+* Appends a line to a job's queue, taking a reference to it
+*
+* args: queue - the queue, line - the line to append
+*/
+void queue_push(OutQueue *queue, SharedLine *line) {
+    if (queue->count == queue->cap) {
+        size_t newCap = queue->cap ? queue->cap * 2 : 16;
+        SharedLine **lines = malloc(sizeof(SharedLine *) * newCap);
+        for (size_t k = 0; k < queue->count; k++) {
+            lines[k] = queue->lines[(queue->head + k) % queue->cap];
+        }
+        free(queue->lines);
+        queue->lines = lines;
+        queue->cap = newCap;
+        queue->head = 0;
+    }
+    line->refs++;
+    queue->lines[(queue->head + queue->count) % queue->cap] = line;
+    queue->count++;
+}
+
+/* SharedLine *queue_drop_oldest(OutQueue *queue)
+* -----------------------------------------------
+* Removes the oldest line of a queue that has not been partly written yet
+*
+* args: queue - the queue (must hold at least two lines if the oldest one is
+*     partly written)
+* Returns: the removed line, whose reference passes to the caller
+*/
+SharedLine *queue_drop_oldest(OutQueue *queue) {
+    // A partly written line has to be completed to keep the framing intact,
+    // so the line after it goes instead
+    size_t victim = (queue->offset > 0) ? 1 : 0;
+    size_t slot = (queue->head + victim) % queue->cap;
+    SharedLine *line = queue->lines[slot];
+    if (victim == 0) {
+        queue->head = (queue->head + 1) % queue->cap;
+    } else {
+        queue->lines[slot] = queue->lines[queue->head];
+        queue->head = (queue->head + 1) % queue->cap;
+    }
+    queue->count--;
+    return line;
+}
+
+/* void queue_clear(Supervisor *sv, int j)
+* -----------------------------------------------
+* Discards every line queued for a job
+*
+* args: sv - the supervisor state, j - the job ID
+*/
+void queue_clear(Supervisor *sv, int j) {
+    OutQueue *queue = &sv->jobs.props[j].inQueue;
+    if (queue->count >= (size_t) sv->args.opts.queueLimit) {
+        sv->fullQueues--;
+    }
+    while (queue->count > 0) {
+        shared_line_release(queue->lines[queue->head]);
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->count--;
+    }
+    queue->head = queue->offset = 0;
+}
+
+/* bool serves_requests(Supervisor *sv, int j)
+* -----------------------------------------------
+* Checks whether a job is sent requests with IDs (rpc=...). Spliced input
+* cannot carry IDs, so no job is with -o fanout=splice.
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: true if the job serves requests
+*/
+bool serves_requests(Supervisor *sv, int j) {
+    return sv->jobs.props[j].opts.reply != REPLY_NONE
+            && !sv->args.opts.spliceFanout;
+}
+
+/* int job_window(Supervisor *sv, int j)
+* -----------------------------------------------
+* Gives the most lines a job may have unanswered at once when it serves
+* requests or is a member of a shared group
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: the window
+*/
+int job_window(Supervisor *sv, int j) {
+    int window = sv->jobs.props[j].opts.window;
+    return (window > 0) ? window : GROUP_WINDOW;
+}
+
+/* size_t sendable_lines(Supervisor *sv, int j)
+* -----------------------------------------------
+* Works out how many of the lines queued for a job may be written to it now:
+* all of them, unless it serves requests, in which case only as many as keep
+* its written and unanswered requests within its window
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: the number of queued lines that may be written
+*/
+size_t sendable_lines(Supervisor *sv, int j) {
+    JobProps *job = &sv->jobs.props[j];
+    OutQueue *queue = &job->inQueue;
+    if (!serves_requests(sv, j)) {
+        return queue->count;
+    }
+    long written = (long) job->inFlight - (long) queue->count;
+    long room = job_window(sv, j) - ((written > 0) ? written : 0);
+    if (queue->offset > 0 && room < 1) {
+        // A partly written request is finished whatever the window
+        room = 1;
+    }
+    if (room <= 0) {
+        return 0;
+    }
+    return ((size_t) room < queue->count) ? (size_t) room : queue->count;
+}
+
+/* RequestLog *request_log(Supervisor *sv, int j)
+* -----------------------------------------------
+* Finds the log a job's requests are kept in: its group's, so that replies
+* from any member are written in the order the group was dispatched to, or
+* its own
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: the log
+*/
+RequestLog *request_log(Supervisor *sv, int j) {
+    int g = sv->jobs.props[j].group;
+    return (g >= 0) ? &sv->groups[g].requests : &sv->jobs.props[j].requests;
+}
+
+/* void request_push(RequestLog *log, unsigned long long seq, int j)
+* -----------------------------------------------
+* Adds a request to the end of a log
+*
+* args: log - the log, seq - the request ID, j - the job it was sent to
+*/
+void request_push(RequestLog *log, unsigned long long seq, int j) {
+    if (log->count == log->cap) {
+        size_t newCap = log->cap ? log->cap * 2 : 16;
+        Request *items = malloc(sizeof(Request) * newCap);
+        for (size_t k = 0; k < log->count; k++) {
+            items[k] = log->items[(log->head + k) % log->cap];
+        }
+        free(log->items);
+        log->items = items;
+        log->cap = newCap;
+        log->head = 0;
+    }
+    Request *request = &log->items[(log->head + log->count) % log->cap];
+    request->seq = seq;
+    request->job = j;
+    request->answered = false;
+    request->reply = NULL;
+    log->count++;
+}
+
+/* Request *find_request(RequestLog *log, unsigned long long seq, int j)
+* -----------------------------------------------
+* Looks up the unanswered request with the given ID sent to a job, by binary
+* search since the log is in order of request IDs
+*
+* args: log - the log, seq - the request ID, j - the job ID
+* Returns: the request, or NULL if there is none
+*/
+Request *find_request(RequestLog *log, unsigned long long seq, int j) {
+    size_t low = 0, high = log->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (log->items[(log->head + mid) % log->cap].seq < seq) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Every member of a broadcast group is sent the same request
+    for (; low < log->count; low++) {
+        Request *request = &log->items[(log->head + low) % log->cap];
+        if (request->seq != seq) {
+            break;
+        }
+        if (request->job == j && !request->answered) {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+/* void answer_request(Supervisor *sv, int j, LineView *reply)
+* -----------------------------------------------
+* Matches a reply written by a job serving requests to the request whose ID
+* it starts with. The reply is written at once under rpc=completion, and
+* under rpc=input once every earlier request is answered or lost. A reply
+* that matches no request, e.g. one to a request lost in a reload, is
+* written at once.
+*
+* args: sv - the supervisor state, j - the job ID, reply - the reply
+*/
+void answer_request(Supervisor *sv, int j, LineView *reply) {
+    JobProps *job = &sv->jobs.props[j];
+    unsigned long long seq = 0;
+    size_t digits = 0;
+    while (digits < reply->len && isdigit((unsigned char) reply->data[digits])
+            && digits < 20) {
+        seq = seq * 10 + (reply->data[digits++] - '0');
+    }
+    RequestLog *log = request_log(sv, j);
+    Request *request = NULL;
+    if (digits > 0 && (digits == reply->len || reply->data[digits] == ' ')) {
+        request = find_request(log, seq, j);
+        replay_answer(&job->replay, seq);
+    }
+    if (request == NULL) {
+        if (sv->args.verboseFlag) {
+            fprintf(stderr, "Job %d replied to no pending request\n", j);
+        }
+        report_output(sv, j, reply->data, reply->len);
+        return;
+    }
+    request->answered = true;
+    if (job->opts.reply == REPLY_COMPLETION) {
+        report_output(sv, j, reply->data, reply->len);
+    } else {
+        request->reply = malloc(reply->len + 1);
+        memcpy(request->reply, reply->data, reply->len);
+        request->replyLen = reply->len;
+    }
+    release_requests(sv, log, false);
+}
+
+/* void lose_requests(Supervisor *sv, int j, bool all)
+* -----------------------------------------------
+* Gives up on the requests sent to a job whose run has ended that it did not
+* answer, so that replies after them are not held back forever. Requests in
+* the job's replay ring are sent again to its next run, and are only given
+* up on if it is not restarted.
+*
+* args: sv - the supervisor state, j - the job ID, all - true to give up on
+*     the requests in the replay ring too
+*/
+void lose_requests(Supervisor *sv, int j, bool all) {
+    RequestLog *log = request_log(sv, j);
+    OutQueue *ring = &sv->jobs.props[j].replay;
+    int lost = 0;
+    for (size_t k = 0; k < log->count; k++) {
+        Request *request = &log->items[(log->head + k) % log->cap];
+        if (request->job == j && !request->answered
+                && (all || !request_in_ring(ring, request->seq))) {
+            request->answered = true;
+            lost++;
+        }
+    }
+    if (lost > 0 && sv->args.verboseFlag) {
+        fprintf(stderr, "Lost %d requests sent to job %d\n", lost, j);
+    }
+    release_requests(sv, log, false);
+}
+
+/* void lose_request(Supervisor *sv, int j, unsigned long long seq)
+* -----------------------------------------------
+* Gives up on a request dropped from a job's queue before it was written
+*
+* args: sv - the supervisor state, j - the job ID, seq - the request ID
+*/
+void lose_request(Supervisor *sv, int j, unsigned long long seq) {
+    RequestLog *log = request_log(sv, j);
+    Request *request = find_request(log, seq, j);
+    if (request != NULL) {
+        request->answered = true;
+        release_requests(sv, log, false);
+    }
+}
+
+/* bool request_in_ring(OutQueue *ring, unsigned long long seq)
+* -----------------------------------------------
+* Checks whether a request is kept in a replay ring to be sent again
+*
+* args: ring - the replay ring, seq - the request ID
+* Returns: true if it is
+*/
+bool request_in_ring(OutQueue *ring, unsigned long long seq) {
+    for (size_t k = 0; k < ring->count; k++) {
+        SharedLine *line = ring->lines[(ring->head + k) % ring->cap];
+        if (line != NULL && line->seq == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* void release_requests(Supervisor *sv, RequestLog *log, bool force)
+* -----------------------------------------------
+* Writes out the replies at the front of a log whose earlier requests have
+* all been answered or lost, and removes those requests
+*
+* args: sv - the supervisor state, log - the log, force - true to write out
+*     every reply held, skipping unanswered requests, and empty the log
+*/
+void release_requests(Supervisor *sv, RequestLog *log, bool force) {
+    bool written = false;
+    while (log->count > 0) {
+        Request *request = &log->items[log->head];
+        if (!request->answered && !force) {
+            break;
+        }
+        if (request->reply != NULL) {
+            report_output(sv, request->job, request->reply,
+                    request->replyLen);
+            free(request->reply);
+            written = true;
+        }
+        log->head = (log->head + 1) % log->cap;
+        log->count--;
+    }
+    if (written) {
+        end_console_line(sv);
+    }
+}
+
+/* void release_all_requests(Supervisor *sv)
+* -----------------------------------------------
+* Writes out every reply held back and forgets every pending request, before
+* the groups are rebuilt by a reload or at exit. Replies to the forgotten
+* requests are written as they arrive.
+*
+* args: sv - the supervisor state
+*/
+void release_all_requests(Supervisor *sv) {
+    for (int j = 1; j <= sv->jobs.count; j++) {
+        release_requests(sv, &sv->jobs.props[j].requests, true);
+    }
+    for (int g = 0; g < sv->groupCount; g++) {
+        release_requests(sv, &sv->groups[g].requests, true);
+    }
+}
+
+/* size_t replay_limit(Supervisor *sv, int j)
+* -----------------------------------------------
+* Works out how many lines a job's replay ring holds: the size given in the
+* jobfile, but never more than the queue limit, so that a replay always fits
+* in the queue of the job's next run
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: the size of the ring, 0 if the job has none
+*/
+size_t replay_limit(Supervisor *sv, int j) {
+    size_t size = sv->jobs.props[j].opts.replay;
+    size_t limit = sv->args.opts.queueLimit;
+    return (size < limit) ? size : limit;
+}
+
+/* void replay_record(Supervisor *sv, int j, SharedLine *line)
+* -----------------------------------------------
+* Keeps a line queued for a job in its replay ring until the job acknowledges
+* it by writing a line of output. A job with more unanswered lines than its
+* ring holds loses the oldest ones.
+*
+* args: sv - the supervisor state, j - the job ID, line - the line
+*/
+void replay_record(Supervisor *sv, int j, SharedLine *line) {
+    size_t limit = replay_limit(sv, j);
+    if (limit == 0) {
+        return;
+    }
+    OutQueue *ring = &sv->jobs.props[j].replay;
+    replay_trim(ring, limit - 1);
+    queue_push(ring, line);
+}
+
+/* void replay_trim(OutQueue *ring, size_t keep)
+* -----------------------------------------------
+* Forgets the oldest lines of a replay ring until no more than keep are left
+*
+* args: ring - the replay ring, keep - the number of lines to keep
+*/
+void replay_trim(OutQueue *ring, size_t keep) {
+    while (ring->count > keep) {
+        if (ring->lines[ring->head] != NULL) {
+            shared_line_release(ring->lines[ring->head]);
+        }
+        ring->head = (ring->head + 1) % ring->cap;
+        ring->count--;
+    }
+}
+
+/* void replay_ack(OutQueue *ring)
+* -----------------------------------------------
+* Forgets the oldest line of a replay ring once the job has answered it,
+* along with any dropped lines ahead of it, which it never got
+*
+* args: ring - the replay ring
+*/
+void replay_ack(OutQueue *ring) {
+    while (ring->count > 0) {
+        SharedLine *line = ring->lines[ring->head];
+        ring->head = (ring->head + 1) % ring->cap;
+        ring->count--;
+        if (line != NULL) {
+            shared_line_release(line);
+            return;
+        }
+    }
+}
+
+/* void replay_forget(OutQueue *ring, SharedLine *line)
+* -----------------------------------------------
+* Marks a line dropped from a job's queue before it was written as never sent
+* in the job's replay ring. The line is among the newest in the ring, so the
+* search starts there.
+*
+* args: ring - the replay ring, line - the dropped line
+*/
+void replay_forget(OutQueue *ring, SharedLine *line) {
+    for (size_t k = ring->count; k > 0; k--) {
+        size_t slot = (ring->head + k - 1) % ring->cap;
+        if (ring->lines[slot] == line) {
+            ring->lines[slot] = NULL;
+            shared_line_release(line);
+            return;
+        }
+    }
+}
+
+/* void replay_answer(OutQueue *ring, unsigned long long seq)
+* -----------------------------------------------
+* Forgets a request of a replay ring once the job has answered it, which
+* need not be the oldest one, along with the dropped and answered entries
+* ahead of the oldest unanswered one
+*
+* args: ring - the replay ring, seq - the ID of the answered request
+*/
+void replay_answer(OutQueue *ring, unsigned long long seq) {
+    for (size_t k = 0; k < ring->count; k++) {
+        size_t slot = (ring->head + k) % ring->cap;
+        if (ring->lines[slot] != NULL && ring->lines[slot]->seq == seq) {
+            shared_line_release(ring->lines[slot]);
+            ring->lines[slot] = NULL;
+            break;
+        }
+    }
+    while (ring->count > 0 && ring->lines[ring->head] == NULL) {
+        ring->head = (ring->head + 1) % ring->cap;
+        ring->count--;
+    }
+}
+
+/* void replay_lines(Supervisor *sv, int j)
+* -----------------------------------------------
+* Queues the lines a job had not answered when its previous run ended for the
+* new run, ahead of any new input. They were reported and counted when first
+* sent, so they are not again.
+*
+* args: sv - the supervisor state, j - the job ID
+*/
+void replay_lines(Supervisor *sv, int j) {
+    JobProps *job = &sv->jobs.props[j];
+    OutQueue *ring = &job->replay;
+    int replayed = 0;
+    for (size_t k = 0; k < ring->count; k++) {
+        SharedLine *line = ring->lines[(ring->head + k) % ring->cap];
+        if (line != NULL) {
+            queue_push(&job->inQueue, line);
+            replayed++;
+        }
+    }
+    if (replayed == 0) {
+        return;
+    }
+    if (job->inQueue.count == (size_t) sv->args.opts.queueLimit) {
+        sv->fullQueues++;
+    }
+    job->metrics.replayed += replayed;
+    job->inFlight += replayed;
+    if (sv->args.verboseFlag) {
+        fprintf(stderr, "Replaying %d lines to worker %d\n", replayed, j);
+    }
+    job->metrics.awaitingSince = now_us();
+    if (job->opts.deadlineMs > 0) {
+        arm_watchdog(sv, j);
+    }
+    flush_job_queue(sv, j);
+}
+
+/* void enqueue_line(Supervisor *sv, int j, SharedLine *line)
+* -----------------------------------------------
+* Queues a line for a job and writes as much of its queue as the pipe takes.
+* If the queue is full, the slow consumer policy decides what gives way.
+*
+* args: sv - the supervisor state, j - the job ID, line - the line to send
+*/
+void enqueue_line(Supervisor *sv, int j, SharedLine *line) {
+    JobProps *job = &sv->jobs.props[j];
+    OutQueue *queue = &job->inQueue;
+    size_t limit = sv->args.opts.queueLimit;
+    if (!make_room(sv, j)) {
+        return;
+    }
+    queue_push(queue, line);
+    if (queue->count == limit) {
+        sv->fullQueues++;
+    }
+    replay_record(sv, j, line);
+    if (serves_requests(sv, j)) {
+        request_push(request_log(sv, j), line->seq, j);
+    }
+    printf("%d<-'%.*s'\n", j, (int) line->len - 1, line->data);
+    end_console_line(sv);
+    sv->jobs.linesto[j]++;
+    job->inFlight++;
+    job->metrics.linesIn++;
+    if (job->metrics.awaitingSince == 0) {
+        job->metrics.awaitingSince = now_us();
+        if (job->opts.deadlineMs > 0) {
+            arm_watchdog(sv, j);
+        }
+    }
+    if (!job->writeWatched) {
+        flush_job_queue(sv, j);
+    }
+}
+
+/* bool make_room(Supervisor *sv, int j)
+* -----------------------------------------------
+* Applies the slow consumer policy to a job whose queue is full
+*
+* args: sv - the supervisor state, j - the job ID
+* Returns: true if a line may be queued for the job
+*/
+bool make_room(Supervisor *sv, int j) {
+    OutQueue *queue = &sv->jobs.props[j].inQueue;
+    if (queue->count < (size_t) sv->args.opts.queueLimit) {
+        return true;
+    }
+    if (sv->args.opts.slowPolicy == SLOW_RESTART) {
+        if (sv->args.verboseFlag) {
+            fprintf(stderr, "Job %d is too slow, restarting\n", j);
+        }
+        queue_clear(sv, j);
+        kill(sv->jobs.pids[j], SIGKILL);
+        return false;
+    }
+    if (sv->args.opts.spliceFanout) {
+        // Spliced chunks do not end on line boundaries, so none can be
+        // dropped; input is paused instead, as under slow=block
+        return true;
+    }
+    // No input is read while a queue is full under slow=block, so a full
+    // queue here means lines have to be dropped
+    if (queue->offset > 0 && queue->count < 2) {
+        return false;
+    }
+    SharedLine *line = queue_drop_oldest(queue);
+    replay_forget(&sv->jobs.props[j].replay, line);
+    if (serves_requests(sv, j)) {
+        lose_request(sv, j, line->seq);
+    }
+    shared_line_release(line);
+    sv->jobs.props[j].metrics.dropped++;
+    if (sv->args.verboseFlag) {
+        fprintf(stderr, "Dropped a line queued for job %d\n", j);
+    }
+    sv->fullQueues--;
+    return true;
+}
+
+/* void splice_input(Supervisor *sv)
+* -----------------------------------------------
+* Moves the next chunk of the main input to every job without it entering
+* user space (-o fanout=splice): the chunk is spliced into a staging pipe and
+* teed into each job's stdin pipe. A job whose pipe cannot take the whole
+* chunk, or which still has data queued, gets the rest of the chunk through
+* its queue instead, which is the only time the data is copied.
+*
+* args: sv - the supervisor state
+*/
+void splice_input(Supervisor *sv) {
+    ssize_t staged = splice(STDIN_FILENO, NULL, sv->stagePipe[WRITE_END],
+            NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (staged == 0) {
+        begin_drain(sv);
+        return;
+    } else if (staged == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("splice");
+            begin_drain(sv);
+        }
+        return;
+    }
+    bool needCopy = false;
+    JobTable *jobs = &sv->jobs;
+    for (int j = 1; j <= jobs->count; j++) {
+        JobProps *job = &jobs->props[j];
+        job->teeOffset = staged;
+        if ((jobs->states[j] & (JOB_RUNNABLE | JOB_ENDED)) != JOB_RUNNABLE
+                || jobs->inFds[j] < 0) {
+            continue;
+        }
+        if (job->inQueue.count == 0) {
+            ssize_t teed = tee(sv->stagePipe[READ_END], jobs->inFds[j],
+                    staged, SPLICE_F_NONBLOCK);
+            if (teed > 0) {
+                job->metrics.bytesIn += teed;
+            }
+            if (teed == staged || (teed == -1 && errno == EPIPE)) {
+                continue;
+            }
+            job->teeOffset = (teed > 0) ? teed : 0;
+        } else {
+            job->teeOffset = 0;
+        }
+        needCopy = true;
+    }
+    if (!needCopy) {
+        splice(sv->stagePipe[READ_END], NULL, sv->nullFd, NULL, staged,
+                SPLICE_F_MOVE);
+        return;
+    }
+    SharedLine *chunk = shared_line_alloc(staged);
+    size_t got = 0;
+    while (got < (size_t) staged) {
+        ssize_t n = read(sv->stagePipe[READ_END], chunk->data + got,
+                staged - got);
+        if (n <= 0 && errno != EINTR) {
+            break;
+        }
+        got += (n > 0) ? n : 0;
+    }
+    for (int j = 1; j <= jobs->count; j++) {
+        if (jobs->props[j].teeOffset < (size_t) staged) {
+            enqueue_chunk_tail(sv, j, chunk);
+        }
+    }
+    shared_line_release(chunk);
+}
+
+/* void enqueue_chunk_tail(Supervisor *sv, int j, SharedLine *chunk)
+* -----------------------------------------------
+* Queues the part of a spliced chunk that could not be teed to a job
+*
+* args: sv - the supervisor state, j - the job ID, chunk - the whole chunk;
+*     the job's teeOffset gives how much of it the job already has
+*/
+void enqueue_chunk_tail(Supervisor *sv, int j, SharedLine *chunk) {
+    JobProps *job = &sv->jobs.props[j];
+    OutQueue *queue = &job->inQueue;
+    if (!make_room(sv, j)) {
+        return;
+    }
+    queue_push(queue, chunk);
+    if (queue->count == 1) {
+        queue->offset = job->teeOffset;
+    }
+    if (queue->count == (size_t) sv->args.opts.queueLimit) {
+        sv->fullQueues++;
+    }
+    if (!job->writeWatched) {
+        flush_job_queue(sv, j);
+    }
+}
+
+/* void flush_job_queue(Supervisor *sv, int j)
+* -----------------------------------------------
+* Writes as many queued lines to a job's stdin pipe as it accepts without
+* blocking, several lines per writev call. A job with framed records gets
+* each line without its newline, with the record's header and trailer
+* written from alongside it rather than copied into one buffer, and a job
+* serving requests gets each one after its ID, and no more than its window
+* allows. If lines remain, the event loop is asked to call again once the
+* pipe is writable.
+*
+* args: sv - the supervisor state, j - the job ID
+*/
+void flush_job_queue(Supervisor *sv, int j) {
+    JobProps *job = &sv->jobs.props[j];
+    int *fd = &sv->jobs.inFds[j];
+    OutQueue *queue = &job->inQueue;
+    size_t limit = sv->args.opts.queueLimit;
+    bool wasFull = queue->count >= limit;
+    // Spliced chunks are not lines, so they cannot be framed
+    FrameMode frame = sv->args.opts.spliceFanout ? FRAME_LINE : job->frame;
+    bool tagged = serves_requests(sv, j);
+    bool plain = frame == FRAME_LINE && !tagged;
+    size_t sendable;
+    while ((sendable = sendable_lines(sv, j)) > 0 && *fd >= 0) {
+        struct iovec iov[IOV_BATCH];
+        // A framed line takes one to three entries of iov, as its header or
+        // body may be empty or already written, so each gets its own header
+        char headers[IOV_BATCH][48];
+        int iovCount = 0, framed = 0;
+        for (size_t k = 0; k < sendable && iovCount < IOV_BATCH; k++) {
+            SharedLine *line = queue->lines[(queue->head + k) % queue->cap];
+            size_t skip = (k == 0) ? queue->offset : 0;
+            if (plain) {
+                iov[iovCount].iov_base = line->data + skip;
+                iov[iovCount].iov_len = line->len - skip;
+                iovCount++;
+            } else if (iovCount + 3 <= IOV_BATCH) {
+                iovCount += frame_line(frame, line, tagged, skip,
+                        headers[framed++], iov + iovCount);
+            } else {
+                break;
+            }
+        }
+        ssize_t written = writev(*fd, iov, iovCount);
+        if (written > 0) {
+            job->metrics.bytesIn += written;
+        }
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                // The job has closed its stdin; it is dealt with when reaped
+                queue_clear(sv, j);
+                wasFull = false;
+            }
+            break;
+        }
+        while (written > 0) {
+            SharedLine *line = queue->lines[queue->head];
+            size_t remaining = plain ? line->len - queue->offset
+                    : frame_size(frame, line, tagged) - queue->offset;
+            if ((size_t) written < remaining) {
+                queue->offset += written;
+                break;
+            }
+            written -= remaining;
+            queue->offset = 0;
+            shared_line_release(line);
+            queue->head = (queue->head + 1) % queue->cap;
+            queue->count--;
+        }
+    }
+    if (wasFull && queue->count < limit) {
+        sv->fullQueues--;
+    }
+    set_write_interest(sv, j, sendable_lines(sv, j) > 0);
+    // At the end of the input, or once a job is being stopped, its stdin is
+    // closed as soon as everything queued for it has been written
+    if ((sv->draining || !(sv->jobs.states[j] & JOB_RUNNABLE))
+            && queue->count == 0 && *fd >= 0
+            && !(sv->draining && group_pending(sv, j))) {
+        close(*fd);
+        *fd = -1;
+        job->writeWatched = false;
+    }
+}
+
+/* void set_write_interest(Supervisor *sv, int j, bool want)
+* -----------------------------------------------
+* Starts or stops waiting for a job's stdin pipe to become writable
+*
+* args: sv - the supervisor state, j - the job ID, want - true to wait
+*/
+void set_write_interest(Supervisor *sv, int j, bool want) {
+    JobProps *job = &sv->jobs.props[j];
+    int fd = sv->jobs.inFds[j];
+    if (want == job->writeWatched || fd < 0) {
+        return;
+    }
+    if (want) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.u64 = EVENT_TAG(EV_JOB_IN, j);
+        epoll_ctl(sv->epollFd, EPOLL_CTL_ADD, fd, &ev);
+    } else {
+        epoll_ctl(sv->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    job->writeWatched = want;
+}
+
+/* bool input_wanted(Supervisor *sv)
+* -----------------------------------------------
+* Decides whether the main input should be read at the moment
+*
+* args: sv - the supervisor state
+* Returns: false once the input is exhausted, while it is paused by a control
+*     request or a *sleep directive, or while a job's queue is full under the
+*     blocking slow consumer policy
+*/
+bool input_wanted(Supervisor *sv) {
+    if (sv->draining || sv->inputPaused || sv->sleepUntil != 0) {
+        return false;
+    }
+    return !((sv->args.opts.slowPolicy == SLOW_BLOCK
+            || sv->args.opts.spliceFanout) && sv->fullQueues > 0);
+}
+
+/* void update_input_interest(Supervisor *sv)
+* -----------------------------------------------
+* Starts or stops waiting for the main input according to input_wanted
+*
+* args: sv - the supervisor state
+*/
+void update_input_interest(Supervisor *sv) {
+    bool want = input_wanted(sv);
+    if (want == sv->inputWatched) {
+        return;
+    }
+    sv->inputWatched = want;
+    if (sv->stdinPollable && !sv->draining) {
+        // A paused input leaves the epoll set altogether: with no events
+        // requested, a hung up pipe would still be reported on every wait
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = EVENT_TAG(EV_STDIN, 0);
+        epoll_ctl(sv->epollFd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                sv->inputFd, &ev);
+    }
+}
+
+/* void handle_directive(Supervisor *sv, char *inputLine)
+* -----------------------------------------------
+* Executes a *signal, *sleep or *reload directive read from the input
+*
+* args: sv - the supervisor state, inputLine - the directive line (split in
+*     place)
+*/
+void handle_directive(Supervisor *sv, char *inputLine) {
+    char *inputSplit[3] = {NULL, NULL, NULL};
+    split_fields(inputLine, ' ', inputSplit, 3);
+    char *command = inputSplit[0];
+    int num = -111;
+    int signum = -111;
+    bool invalidNum = false;
+    bool invalidSigNum = false;
+    if (inputSplit[1]) {
+        char *endptr;
+        num = strtol(inputSplit[1], &endptr, 10);
+        if ((endptr == inputSplit[1]) || (*endptr != '\0')) {
+            invalidNum = true;
+        }
+        if (inputSplit[2] && strlen(inputSplit[2])) {
+            signum = strtol(inputSplit[2], &endptr, 10);
+            if ((endptr == inputSplit[2]) || (*endptr != '\0')) {
+                invalidSigNum = true;
+            }
+        }
+    }
+    if (strcmp(command, "*signal") == 0) {
+        if ((num == -111) || (signum == -111)) {
+            printf("Error: Incorrect number of arguments\n");
+        } else if ((num > sv->jobs.count) || (num < 1)
+                || (sv->jobs.states[num] & JOB_ENDED) || (invalidNum)) {
+            printf("Error: Invalid job\n");
+        } else if ((signum < 1) || (signum > 31) || (invalidSigNum)) {
+            printf("Error: Invalid signal\n");
+        } else if (kill(sv->jobs.pids[num], signum) == -1) {
+            fprintf(stderr, "Kill error\n");
+        }
+    } else if (strcmp(command, "*reload") == 0) {
+        if (num != -111) {
+            printf("Error: Incorrect number of arguments\n");
+        } else {
+            reload_jobfile(sv);
+        }
+    } else if (strcmp(command, "*sleep") == 0) {
+        if ((num == -111) || (signum != -111)) {
+            printf("Error: Incorrect number of arguments\n");
+        } else if (num < 0 || invalidNum) {
+            printf("Error: Invalid duration\n");
+        } else if (num > 0) {
+            // Only the input waits; output, exits and timers carry on
+            sv->sleepUntil = now_ms() + num;
+            schedule_timer(sv, sv->sleepUntil, TIMER_INPUT, 0);
+        }
+    } else {
+        printf("Error: Bad command '%s'\n", command);
+    }
+    end_console_line(sv);
+}
+
+/* void read_input(Supervisor *sv, bool readable)
+* -----------------------------------------------
+* Dispatches the lines of the main input, or executes them if they are
+* directives, until no complete line is buffered, the input is paused or
+* MAX_LINES_PER_EVENT lines have been handled. Stdin is read from at most
+* once per call, and only if it is known to be readable, so that the event
+* loop never blocks on it. Mapped input is walked in place instead.
+*
+* args: sv - the supervisor state, readable - true if the event loop found
+*     the main input readable
+*/
+void read_input(Supervisor *sv, bool readable) {
+    LineReader *reader = &sv->input;
+    LineView line;
+    int budget = MAX_LINES_PER_EVENT;
+    sv->inputPending = false;
+    while (input_wanted(sv)) {
+        if (budget-- == 0) {
+            sv->inputPending = true;
+            return;
+        }
+        if (sv->inputMapped) {
+            if (!map_next(reader, &line)) {
+                begin_drain(sv);
+                return;
+            }
+            handle_input_line(sv, &line);
+            if (reader->start - sv->inputReleased >= INPUT_RELEASE_CHUNK) {
+                release_input(sv);
+            }
+            continue;
+        }
+        if (reader_next(reader, &line, false)) {
+            handle_input_line(sv, &line);
+            continue;
+        }
+        if (!readable) {
+            return;
+        }
+        // Taking from the input ring never blocks, so it is repeated until
+        // the ring runs dry, which is also what arms its wakeup again
+        readable = sv->inputRing != NULL;
+        ssize_t got = fill_input(sv);
+        if (got > 0) {
+            continue;
+        } else if (got == -1 && errno == EAGAIN) {
+            return;
+        }
+        // The last line of the input need not end with a newline
+        if (reader_next(reader, &line, true)) {
+            handle_input_line(sv, &line);
+        }
+        begin_drain(sv);
+        return;
+    }
+    // Paused with lines possibly still buffered
+    sv->inputPending = true;
+}
+
+/* void handle_input_line(Supervisor *sv, LineView *line)
+* -----------------------------------------------
+* Executes a line of the main input if it is a directive, and dispatches it
+* to the jobs otherwise
+*
+* args: sv - the supervisor state, line - the line
+*/
+void handle_input_line(Supervisor *sv, LineView *line) {
+    sv->linesRead++;
+    if (line->len > 0 && line->data[0] == '*' && sv->inputMapped) {
+        // The mapping is read only, and the directive is split in place
+        char *directive = malloc(line->len + 1);
+        memcpy(directive, line->data, line->len);
+        directive[line->len] = '\0';
+        handle_directive(sv, directive);
+        free(directive);
+    } else if (line->len > 0 && line->data[0] == '*') {
+        handle_directive(sv, line->data);
+    } else {
+        dispatch_line(sv, line->data, line->len);
+    }
+}
+
+/* bool map_input(Supervisor *sv)
+* -----------------------------------------------
+* Maps the main input if it is a regular file (e.g. -i inputfile), so that
+* its lines are dispatched straight from the page cache without being
+* copied into the input buffer first. Reading starts at the current offset
+* of stdin.
+*
+* args: sv - the supervisor state
+* Returns: true if the input was mapped, false if it is to be read
+*/
+bool map_input(Supervisor *sv) {
+    struct stat info;
+    if (fstat(STDIN_FILENO, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset == -1 || offset >= info.st_size) {
+        return false;
+    }
+    char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+            STDIN_FILENO, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    sv->input.data = data;
+    sv->input.start = offset;
+    sv->input.end = sv->input.cap = info.st_size;
+    // Whole pages before the offset are never read
+    sv->inputReleased = offset & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+    return true;
+}
+
+/* bool map_next(LineReader *reader, LineView *line)
+* -----------------------------------------------
+* Takes the next line of a reader over mapped input. Unlike reader_next, the
+* line is left in place, ending at its newline rather than a null byte, and
+* a trailing partial line is the last line of the file.
+*
+* args: reader - the reader, line - where the view of the line is stored
+* Returns: true if a line was returned, false at the end of the input
+*/
+bool map_next(LineReader *reader, LineView *line) {
+    if (reader->start == reader->end) {
+        return false;
+    }
+    char *start = reader->data + reader->start;
+    char *end = reader->data + reader->end;
+    char *newline = memchr(start, '\n', end - start);
+    if (newline == NULL) {
+        newline = end;
+    }
+    line->data = start;
+    line->len = newline - start;
+    reader->start = (newline < end) ? newline + 1 - reader->data
+            : reader->end;
+    return true;
+}
+
+/* void release_input(Supervisor *sv)
+* -----------------------------------------------
+* Gives back the pages of the mapped input that every line has been taken
+* from, both from the supervisor and from the page cache, so that replaying
+* a file larger than memory does not crowd out everything else. Dispatched
+* lines are copies, so nothing points into them any more.
+*
+* args: sv - the supervisor state
+*/
+void release_input(Supervisor *sv) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t upTo = sv->input.start & ~(page - 1);
+    if (upTo > sv->inputReleased) {
+        madvise(sv->input.data + sv->inputReleased, upTo - sv->inputReleased,
+                MADV_DONTNEED);
+        posix_fadvise(STDIN_FILENO, sv->inputReleased,
+                upTo - sv->inputReleased, POSIX_FADV_DONTNEED);
+        sv->inputReleased = upTo;
+    }
+}
+
+/* void reader_init(LineReader *reader, size_t cap)
+* -----------------------------------------------
+* Sets up an empty line reader
+*
+* args: reader - the reader, cap - the initial size of its buffer (0 to
+*     allocate it on the first read)
+*/
+void reader_init(LineReader *reader, size_t cap) {
+    reader->data = cap ? malloc(cap) : NULL;
+    reader->start = reader->end = 0;
+    reader->cap = cap;
+}
+
+/* ssize_t reader_fill(LineReader *reader, int fd)
+* -----------------------------------------------
+* Reads once from a descriptor into a line reader's buffer. A partial line is
+* only moved to the front of the buffer when the buffer is nearly full, and
+* the buffer only grows when the partial line fills most of it.
+*
+* args: reader - the reader, fd - the descriptor to read from
+* Returns: the result of read(): the number of bytes read, 0 at EOF or -1 on
+*     error (never EINTR)
+*/
+ssize_t reader_fill(LineReader *reader, int fd) {
+    size_t room = reader_reserve(reader);
+    ssize_t got;
+    do {
+        got = read(fd, reader->data + reader->end, room);
+    } while (got == -1 && errno == EINTR);
+    if (got > 0) {
+        reader->end += got;
+    }
+    return got;
+}
+
+/* size_t reader_reserve(LineReader *reader)
+* -----------------------------------------------
+* Makes room for more bytes at the end of a line reader's buffer. A partial
+* line is only moved to the front of the buffer when the buffer is nearly
+* full, and the buffer only grows when the partial line fills most of it.
+*
+* args: reader - the reader
+* Returns: the number of bytes that fit after reader->end
+*/
+size_t reader_reserve(LineReader *reader) {
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    }
+    if (reader->cap - reader->end <= READ_CHUNK) {
+        if (reader->start > 0) {
+            memmove(reader->data, reader->data + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->cap - reader->end <= READ_CHUNK) {
+            reader->cap = reader->cap ? reader->cap * 2 : READ_CHUNK * 2;
+            reader->data = realloc(reader->data, reader->cap);
+        }
+    }
+    return reader->cap - reader->end - 1;
+}
+
+/* ssize_t fill_input(Supervisor *sv)
+* -----------------------------------------------
+* Reads once from the main input into its line reader, taking what the input
+* thread has queued if there is one
+*
+* args: sv - the supervisor state
+* Returns: as for reader_fill: the number of bytes read, 0 at EOF or -1 with
+*     errno set to EAGAIN if nothing is available yet
+*/
+ssize_t fill_input(Supervisor *sv) {
+    ByteRing *ring = sv->inputRing;
+    if (ring == NULL) {
+        return reader_fill(&sv->input, STDIN_FILENO);
+    }
+    struct iovec iov[2];
+    size_t len = byte_ring_peek(ring, iov);
+    if (len == 0) {
+        // Reset the eventfd first, so bytes queued from here on wake the
+        // event loop again
+        uint64_t count;
+        if (read(ring->dataFd, &count, sizeof(count)) == -1) {
+            count = 0;
+        }
+        if (byte_ring_idle(ring)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        len = byte_ring_peek(ring, iov);
+        if (len == 0) {
+            return 0;
+        }
+    }
+    LineReader *reader = &sv->input;
+    size_t room = reader_reserve(reader);
+    size_t taken = 0;
+    for (int k = 0; k < 2 && taken < room; k++) {
+        size_t part = iov[k].iov_len;
+        if (part > room - taken) {
+            part = room - taken;
+        }
+        memcpy(reader->data + reader->end + taken, iov[k].iov_base, part);
+        taken += part;
+    }
+    reader->end += taken;
+    byte_ring_consume(ring, taken);
+    return taken;
+}
+
+/* void byte_ring_init(ByteRing *ring, size_t cap, bool pollable)
+* -----------------------------------------------
+* Sets up an empty byte ring
+*
+* args: ring - the ring, cap - its size (a power of two), pollable - true if
+*     the consumer waits for data with epoll rather than by blocking
+* Errors: exits with code 4 if the eventfds cannot be created
+*/
+void byte_ring_init(ByteRing *ring, size_t cap, bool pollable) {
+    ring->data = malloc(cap);
+    ring->cap = cap;
+    ring->head = ring->tail = 0;
+    // The consumer starts out waiting for the first bytes
+    ring->consumerWaiting = 1;
+    ring->closed = ring->producerWaiting = 0;
+    ring->dataFd = eventfd(0, EFD_CLOEXEC | (pollable ? EFD_NONBLOCK : 0));
+    ring->spaceFd = eventfd(0, EFD_CLOEXEC);
+    if (ring->dataFd == -1 || ring->spaceFd == -1) {
+        perror("eventfd");
+        exit(4);
+    }
+}
+
+/* size_t byte_ring_space(ByteRing *ring, struct iovec iov[2])
+* -----------------------------------------------
+* Finds the free part of a ring, for the producer to fill
+*
+* args: ring - the ring, iov - where the (up to two) free extents are stored
+* Returns: the number of free bytes
+*/
+size_t byte_ring_space(ByteRing *ring, struct iovec iov[2]) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t room = ring->cap - (ring->tail - head);
+    size_t at = ring->tail & (ring->cap - 1);
+    size_t first = (room < ring->cap - at) ? room : ring->cap - at;
+    iov[0].iov_base = ring->data + at;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = room - first;
+    return room;
+}
+
+/* void byte_ring_commit(ByteRing *ring, size_t len)
+* -----------------------------------------------
+* Hands bytes the producer has written into the free part of a ring to the
+* consumer, waking it if it waits
+*
+* args: ring - the ring, len - the number of bytes written
+*/
+void byte_ring_commit(ByteRing *ring, size_t len) {
+    __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_SEQ_CST);
+    byte_ring_wake(&ring->consumerWaiting, ring->dataFd);
+}
+
+/* size_t byte_ring_peek(ByteRing *ring, struct iovec iov[2])
+* -----------------------------------------------
+* Finds the queued part of a ring, for the consumer to take
+*
+* args: ring - the ring, iov - where the (up to two) queued extents are
+*     stored
+* Returns: the number of queued bytes
+*/
+size_t byte_ring_peek(ByteRing *ring, struct iovec iov[2]) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t len = tail - ring->head;
+    size_t at = ring->head & (ring->cap - 1);
+    size_t first = (len < ring->cap - at) ? len : ring->cap - at;
+    iov[0].iov_base = ring->data + at;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = len - first;
+    return len;
+}
+
+/* void byte_ring_consume(ByteRing *ring, size_t len)
+* -----------------------------------------------
+* Frees bytes the consumer has taken from a ring, waking the producer if it
+* waits for room
+*
+* args: ring - the ring, len - the number of bytes taken
+*/
+void byte_ring_consume(ByteRing *ring, size_t len) {
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_SEQ_CST);
+    byte_ring_wake(&ring->producerWaiting, ring->spaceFd);
+}
+
+/* void byte_ring_close(ByteRing *ring)
+* -----------------------------------------------
+* Tells the consumer of a ring that nothing more will be added
+*
+* args: ring - the ring
+*/
+void byte_ring_close(ByteRing *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    byte_ring_wake(&ring->consumerWaiting, ring->dataFd);
+}
+
+/* bool byte_ring_idle(ByteRing *ring)
+* -----------------------------------------------
+* Prepares the consumer of a ring to wait for data: raises its waiting flag,
+* then checks once more that the ring is empty, since the producer may have
+* added bytes before it could see the flag
+*
+* args: ring - the ring
+* Returns: true if the consumer may wait on dataFd, false if the ring has
+*     bytes queued or is closed
+*/
+bool byte_ring_idle(ByteRing *ring) {
+    __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head
+            || __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
+}
+
+/* bool byte_ring_wait_data(ByteRing *ring)
+* -----------------------------------------------
+* Blocks the consumer of an empty ring until bytes arrive or it is closed
+*
+* args: ring - the ring
+* Returns: false once the ring is closed and empty
+*/
+bool byte_ring_wait_data(ByteRing *ring) {
+    uint64_t count;
+    if (byte_ring_idle(ring)
+            && read(ring->dataFd, &count, sizeof(count)) == -1) {
+        count = 0;
+    }
+    bool closed = __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST);
+    return !closed
+            || __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head;
+}
+
+/* void byte_ring_wait_space(ByteRing *ring, size_t need)
+* -----------------------------------------------
+* Blocks the producer of a ring with less than need bytes free until the
+* consumer frees some room
+*
+* args: ring - the ring, need - the room the producer is waiting for
+*/
+void byte_ring_wait_space(ByteRing *ring, size_t need) {
+    __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+    uint64_t count;
+    if (ring->cap - (ring->tail - __atomic_load_n(&ring->head,
+            __ATOMIC_SEQ_CST)) < need) {
+        if (read(ring->spaceFd, &count, sizeof(count)) == -1) {
+            count = 0;
+        }
+    } else {
+        __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* void byte_ring_write(ByteRing *ring, const void *data, size_t len)
+* -----------------------------------------------
+* Copies bytes into a ring as the producer, waiting for room whenever the
+* ring is full
+*
+* args: ring - the ring, data - the bytes, len - how many
+*/
+void byte_ring_write(ByteRing *ring, const void *data, size_t len) {
+    const char *bytes = data;
+    size_t done = 0;
+    struct iovec iov[2];
+    while (done < len) {
+        if (byte_ring_space(ring, iov) == 0) {
+            byte_ring_wait_space(ring, 1);
+            continue;
+        }
+        size_t copied = 0;
+        for (int k = 0; k < 2 && done + copied < len; k++) {
+            size_t part = iov[k].iov_len;
+            if (part > len - done - copied) {
+                part = len - done - copied;
+            }
+            memcpy(iov[k].iov_base, bytes + done + copied, part);
+            copied += part;
+        }
+        byte_ring_commit(ring, copied);
+        done += copied;
+    }
+}
+
+/* void byte_ring_read(ByteRing *ring, void *data, size_t len)
+* -----------------------------------------------
+* Copies bytes out of a ring as the consumer and frees them. The bytes must
+* be queued already.
+*
+* args: ring - the ring, data - where the bytes are copied to, len - how
+*     many
+*/
+void byte_ring_read(ByteRing *ring, void *data, size_t len) {
+    struct iovec iov[2];
+    byte_ring_peek(ring, iov);
+    size_t first = (len < iov[0].iov_len) ? len : iov[0].iov_len;
+    memcpy(data, iov[0].iov_base, first);
+    memcpy((char *) data + first, iov[1].iov_base, len - first);
+    byte_ring_consume(ring, len);
+}
+
+/* void byte_ring_wake(int *waiting, int fd)
+* -----------------------------------------------
+* Wakes the other side of a ring if it has raised its waiting flag
+*
+* args: waiting - the flag, fd - the eventfd the other side sleeps on
+*/
+void byte_ring_wake(int *waiting, int fd) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) == -1) {
+            perror("eventfd");
+        }
+    }
+}
+
+/* void start_thread(pthread_t *thread, void *(*run)(void *), void *arg)
+* -----------------------------------------------
+* Starts a helper thread with every signal blocked, so that signals keep
+* going to the event loop thread (SIGCHLD and SIGUSR1 through its signalfd)
+*
+* args: thread - where the thread is stored, run - what it runs, arg - the
+*     argument passed to run
+* Errors: exits with code 4 if the thread cannot be created
+*/
+void start_thread(pthread_t *thread, void *(*run)(void *), void *arg) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(thread, NULL, run, arg) != 0) {
+        fprintf(stderr, "Error: unable to start a thread\n");
+        exit(4);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* void *input_thread(void *arg)
+* -----------------------------------------------
+* Reads stdin straight into the free part of the input ring until EOF, and
+* then closes the ring (-o threads=on)
+*
+* args: arg - the input ring
+* Returns: NULL
+*/
+void *input_thread(void *arg) {
+    ByteRing *ring = arg;
+    struct iovec iov[2];
+    while (true) {
+        if (byte_ring_space(ring, iov) == 0) {
+            byte_ring_wait_space(ring, 1);
+            continue;
+        }
+        ssize_t got = readv(STDIN_FILENO, iov, iov[1].iov_len ? 2 : 1);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            break;
+        }
+        byte_ring_commit(ring, got);
+    }
+    byte_ring_close(ring);
+    return NULL;
+}
+
+/* void start_console_writer(void)
+* -----------------------------------------------
+* Moves writing stdout to a thread of its own (-o threads=on). stdout is
+* replaced by a stream whose flushes copy into consoleRing, from which the
+* writer thread writes out as much as has built up at once. Output is still
+* flushed line by line and in the same order, but the event loop only waits
+* for the terminal or pipe behind stdout once the ring is full.
+*/
+void start_console_writer(void) {
+    fflush(stdout);
+    byte_ring_init(&consoleRing, CONSOLE_RING_SIZE, false);
+    cookie_io_functions_t io = {NULL, console_write, NULL, NULL};
+    FILE *stream = fopencookie(&consoleRing, "w", io);
+    setvbuf(stream, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    stdout = stream;
+    start_thread(&consoleThread, console_thread, &consoleRing);
+    atexit(stop_console_writer);
+}
+
+/* void stop_console_writer(void)
+* -----------------------------------------------
+* Flushes stdout and waits for the writer thread to write out everything
+* queued, at exit
+*/
+void stop_console_writer(void) {
+    fflush(stdout);
+    byte_ring_close(&consoleRing);
+    pthread_join(consoleThread, NULL);
+}
+
+/* ssize_t console_write(void *cookie, const char *data, size_t len)
+* -----------------------------------------------
+* Write function of the stdout stream with -o threads=on: queues the bytes
+* for the writer thread, waiting for room if the ring is full
+*
+* args: cookie - the console ring, data - the bytes, len - how many
+* Returns: len
+*/
+ssize_t console_write(void *cookie, const char *data, size_t len) {
+    byte_ring_write(cookie, data, len);
+    return len;
+}
+
+/* void *console_thread(void *arg)
+* -----------------------------------------------
+* Writes whatever is queued in the console ring to stdout until the ring is
+* closed. If stdout goes away, the rest of the output is discarded.
+*
+* args: arg - the console ring
+* Returns: NULL
+*/
+void *console_thread(void *arg) {
+    ByteRing *ring = arg;
+    struct iovec iov[2];
+    bool broken = false;
+    while (true) {
+        size_t len = byte_ring_peek(ring, iov);
+        if (len == 0) {
+            if (!byte_ring_wait_data(ring)) {
+                break;
+            }
+            continue;
+        }
+        ssize_t written = broken ? (ssize_t) len
+                : writev(STDOUT_FILENO, iov, iov[1].iov_len ? 2 : 1);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
+            broken = true;
+            written = len;
+        }
+        byte_ring_consume(ring, written);
+    }
+    return NULL;
+}
+
+/* void start_collectors(Supervisor *sv)
+* -----------------------------------------------
+* Starts the output collector threads (-o collectors=N), and has the event
+* loop wait on their rings. By default threads=on starts one per CPU left
+* over by the event loop, and at least one.
+*
+* args: sv - the supervisor state
+* Errors: exits with code 4 if a collector cannot be set up
+*/
+void start_collectors(Supervisor *sv) {
+    int count = sv->args.opts.collectors;
+    if (count < 0 && !sv->args.opts.threaded) {
+        count = 0;
+    } else if (count < 0) {
+        long spare = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        count = (spare < 1) ? 1 : (spare > MAX_COLLECTORS) ? MAX_COLLECTORS
+                : (int) spare;
+    }
+    sv->collectorCount = count;
+    sv->collectors = count ? calloc(count, sizeof(Collector)) : NULL;
+    sv->collectPending = false;
+    for (int c = 0; c < count; c++) {
+        Collector *collector = &sv->collectors[c];
+        collector->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        collector->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (collector->epollFd == -1 || collector->wakeFd == -1) {
+            perror("collector");
+            exit(4);
+        }
+        pthread_mutex_init(&collector->lock, NULL);
+        byte_ring_init(&collector->out, COLLECTOR_RING_SIZE, true);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = UINT64_MAX;
+        epoll_ctl(collector->epollFd, EPOLL_CTL_ADD, collector->wakeFd, &ev);
+        epoll_watch(sv->epollFd, collector->out.dataFd, EV_COLLECTOR, c);
+        start_thread(&collector->thread, collector_thread, collector);
+        // Never joined: at exit it may still be waiting on its pipes
+        pthread_detach(collector->thread);
+    }
+}
+
+/* void *collector_thread(void *arg)
+* -----------------------------------------------
+* Reads the stdout pipes handed to an output collector as they become
+* readable and queues each chunk read, and the EOF of each pipe, for the
+* event loop. Commands are applied before every wait.
+*
+* args: arg - the collector
+* Returns: NULL (never returns)
+*/
+void *collector_thread(void *arg) {
+    Collector *collector = arg;
+    // Indexed by job ID: the pipe read for each job and the run it is of
+    int *fds = NULL;
+    unsigned *tags = NULL;
+    int cap = 0;
+    CollectCommand *spare = NULL;
+    int spareCap = 0;
+    char *message = malloc(sizeof(CollectHeader) + COLLECT_CHUNK);
+    CollectHeader *header = (CollectHeader *) message;
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        pthread_mutex_lock(&collector->lock);
+        CollectCommand *commands = collector->commands;
+        int count = collector->commandCount;
+        int commandCap = collector->commandCap;
+        collector->commands = spare;
+        collector->commandCap = spareCap;
+        collector->commandCount = 0;
+        pthread_mutex_unlock(&collector->lock);
+        for (int k = 0; k < count; k++) {
+            CollectCommand *command = &commands[k];
+            int j = command->job;
+            if (j >= cap) {
+                int newCap = cap ? cap : JOB_TABLE_MIN_CAPACITY;
+                while (newCap <= j) {
+                    newCap *= 2;
+                }
+                fds = realloc(fds, sizeof(int) * newCap);
+                tags = realloc(tags, sizeof(unsigned) * newCap);
+                for (int id = cap; id < newCap; id++) {
+                    fds[id] = -1;
+                }
+                cap = newCap;
+            }
+            if (fds[j] >= 0 && (command->fd >= 0 || tags[j] == command->tag)) {
+                // Closing the pipe also removes it from the epoll set
+                close(fds[j]);
+                fds[j] = -1;
+            }
+            if (command->fd >= 0) {
+                fds[j] = command->fd;
+                tags[j] = command->tag;
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u64 = j;
+                epoll_ctl(collector->epollFd, EPOLL_CTL_ADD, fds[j], &ev);
+            }
+        }
+        spare = commands;
+        spareCap = commandCap;
+        int ready = epoll_wait(collector->epollFd, events, MAX_EVENTS, -1);
+        for (int e = 0; e < ready; e++) {
+            if (events[e].data.u64 == UINT64_MAX) {
+                uint64_t wakeups;
+                if (read(collector->wakeFd, &wakeups, sizeof(wakeups)) == -1) {
+                    wakeups = 0;
+                }
+                continue;
+            }
+            int j = (int) events[e].data.u64;
+            if (fds[j] < 0) {
+                continue;
+            }
+            ssize_t got = read(fds[j], message + sizeof(CollectHeader),
+                    COLLECT_CHUNK);
+            if (got == -1 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            header->job = j;
+            header->tag = tags[j];
+            header->len = (got > 0) ? got : 0;
+            if (got <= 0) {
+                close(fds[j]);
+                fds[j] = -1;
+            }
+            collector_send(collector, message,
+                    sizeof(CollectHeader) + header->len);
+        }
+    }
+    return NULL;
+}
+
+/* void collector_command(Collector *collector, int job, unsigned tag,
+        int fd)
+* -----------------------------------------------
+* Queues a command for an output collector and wakes it
+*
+* args: collector - the collector, job - the job ID, tag - the run of the
+*     job, fd - the stdout pipe to hand over, -1 to have it closed
+*/
+void collector_command(Collector *collector, int job, unsigned tag, int fd) {
+    pthread_mutex_lock(&collector->lock);
+    if (collector->commandCount == collector->commandCap) {
+        collector->commandCap = collector->commandCap
+                ? collector->commandCap * 2 : 16;
+        collector->commands = realloc(collector->commands,
+                sizeof(CollectCommand) * collector->commandCap);
+    }
+    CollectCommand *command = &collector->commands[collector->commandCount++];
+    command->job = job;
+    command->tag = tag;
+    command->fd = fd;
+    pthread_mutex_unlock(&collector->lock);
+    uint64_t one = 1;
+    if (write(collector->wakeFd, &one, sizeof(one)) == -1) {
+        perror("eventfd");
+    }
+}
+
+/* void collector_send(Collector *collector, const void *message, size_t len)
+* -----------------------------------------------
+* Queues a header and the chunk after it for the event loop in one go, so
+* that the event loop never finds a message only partly queued, waiting for
+* room in the ring if need be
+*
+* args: collector - the collector, message - the header and chunk, len -
+*     their combined length
+*/
+void collector_send(Collector *collector, const void *message, size_t len) {
+    ByteRing *ring = &collector->out;
+    struct iovec iov[2];
+    while (byte_ring_space(ring, iov) < len) {
+        byte_ring_wait_space(ring, len);
+    }
+    size_t first = (len < iov[0].iov_len) ? len : iov[0].iov_len;
+    memcpy(iov[0].iov_base, message, first);
+    memcpy(iov[1].iov_base, (const char *) message + first, len - first);
+    byte_ring_commit(ring, len);
+}
+
+/* void collect_output(Supervisor *sv, int c)
+* -----------------------------------------------
+* Takes the job output an output collector has queued. Only what is queued
+* on entry is taken, so that a busy collector cannot keep the event loop
+* here; if anything was, the event loop calls again before it next waits.
+*
+* args: sv - the supervisor state, c - the collector's index
+*/
+void collect_output(Supervisor *sv, int c) {
+    ByteRing *ring = &sv->collectors[c].out;
+    struct iovec iov[2];
+    size_t queued = byte_ring_peek(ring, iov);
+    if (queued == 0) {
+        // Reset the eventfd first, so output queued from here on wakes the
+        // event loop again
+        uint64_t count;
+        if (read(ring->dataFd, &count, sizeof(count)) == -1) {
+            count = 0;
+        }
+        if (byte_ring_idle(ring)) {
+            return;
+        }
+        queued = byte_ring_peek(ring, iov);
+    }
+    while (queued >= sizeof(CollectHeader)) {
+        CollectHeader header;
+        byte_ring_read(ring, &header, sizeof(header));
+        queued -= sizeof(header) + header.len;
+        take_collected(sv, ring, &header);
+    }
+    sv->collectPending = true;
+}
+
+/* void take_collected(Supervisor *sv, ByteRing *ring, CollectHeader *header)
+* -----------------------------------------------
+* Reports a chunk of a job's output taken from its collector's ring, as
+* read_job_output does for a chunk it reads itself. Output of an earlier run
+* of the job, or of a pipe the event loop has closed, is discarded. At EOF,
+* the exit of the job is reported if it was waiting for it.
+*
+* args: sv - the supervisor state, ring - the collector's ring, header - the
+*     header of the chunk, which is next in the ring
+*/
+void take_collected(Supervisor *sv, ByteRing *ring, CollectHeader *header) {
+    int j = header->job;
+    JobProps *job = &sv->jobs.props[j];
+    size_t left = header->len;
+    if (header->tag != job->outTag || sv->jobs.outFds[j] < 0) {
+        byte_ring_consume(ring, left);
+        return;
+    }
+    if (left == 0) {
+        emit_job_lines(sv, j, true);
+        if (sv->args.verboseFlag) {
+            fprintf(stderr, "Received EOF from job %d\n", j);
+        }
+        // The collector has closed the pipe already
+        sv->jobs.outFds[j] = -1;
+        if (job->exitAt != 0) {
+            job->exitAt = 0;
+            if (!sv->draining) {
+                handle_job_exit(sv, j, job->exitStatus);
+                check_viable_workers(sv);
+            }
+        }
+        return;
+    }
+    if (job->opts.idleMs > 0) {
+        job->lastOutputAt = now_ms();
+    }
+    while (left > 0 && sv->jobs.outFds[j] >= 0) {
+        LineReader *reader = &job->outBuf;
+        size_t part = reader_reserve(reader);
+        part = (part < left) ? part : left;
+        byte_ring_read(ring, reader->data + reader->end, part);
+        reader->end += part;
+        left -= part;
+        emit_job_lines(sv, j, false);
+    }
+    // What is left after a malformed record is discarded
+    byte_ring_consume(ring, left);
+}
+
+/* void close_job_output(Supervisor *sv, int j)
+* -----------------------------------------------
+* Stops reading a job's stdout pipe. A pipe read by an output collector is
+* closed by the collector, and whatever it has queued from it already is
+* discarded.
+*
+* args: sv - the supervisor state, j - the job ID
+*/
+void close_job_output(Supervisor *sv, int j) {
+    int *fd = &sv->jobs.outFds[j];
+    if (*fd < 0) {
+        return;
+    }
+    if (sv->collectorCount > 0) {
+        collector_command(&sv->collectors[j % sv->collectorCount], j,
+                sv->jobs.props[j].outTag, -1);
+    } else {
+        // Closing the pipe also removes it from the epoll set
+        close(*fd);
+    }
+    *fd = -1;
+}
+
+/* bool reader_next(LineReader *reader, LineView *line, bool atEof)
+* -----------------------------------------------
+* Takes the next complete line from a line reader. The newline is found with
+* memchr, which the C library vectorises, and replaced by a null byte.
+*
+* args: reader - the reader, line - where the view of the line is stored,
+*     atEof - true if no more data will arrive, in which case a trailing
+*     partial line is returned too
+* Returns: true if a line was returned
+*/
+bool reader_next(LineReader *reader, LineView *line, bool atEof) {
+    if (reader->start == reader->end) {
+        return false;
+    }
+    char *start = reader->data + reader->start;
+    char *end = reader->data + reader->end;
+    char *newline = memchr(start, '\n', end - start);
+    if (newline == NULL) {
+        if (!atEof) {
+            return false;
+        }
+        // Fits, since reader_fill leaves a byte free at the end
+        newline = end;
+    }
+    *newline = '\0';
+    line->data = start;
+    line->len = newline - start;
+    reader->start = (newline < end) ? newline + 1 - reader->data
+            : reader->end;
+    return true;
+}
+
+/* int record_next(LineReader *reader, LineView *record, FrameMode mode,
+        bool atEof)
+* -----------------------------------------------
+* Takes the next complete record from a line reader. Lines are found as by
+* reader_next; a length prefixed record or netstring is found from its
+* header alone, without looking at the bytes it holds.
+*
+* args: reader - the reader, record - where the view of the record is
+*     stored, mode - how records are delimited, atEof - true if no more data
+*     will arrive (a trailing partial line is returned, a trailing partial
+*     record is not)
+* Returns: 1 if a record was returned, 0 if there is no complete record, -1
+*     if the data is not a valid record, or one over MAX_RECORD_SIZE
+*/
+int record_next(LineReader *reader, LineView *record, FrameMode mode,
+        bool atEof) {
+    if (mode == FRAME_LINE) {
+        return reader_next(reader, record, atEof);
+    }
+    unsigned char *start = (unsigned char *) reader->data + reader->start;
+    size_t avail = reader->end - reader->start;
+    size_t header, len = 0;
+    if (mode == FRAME_LENGTH) {
+        if (avail < 4) {
+            return 0;
+        }
+        len = ((size_t) start[0] << 24) | (start[1] << 16) | (start[2] << 8)
+                | start[3];
+        header = 4;
+    } else {
+        for (header = 0; header < avail && isdigit(start[header]); header++) {
+            len = len * 10 + (start[header] - '0');
+            if (len > MAX_RECORD_SIZE) {
+                return -1;
+            }
+        }
+        if (header == avail) {
+            return 0;
+        } else if (header == 0 || start[header] != ':') {
+            return -1;
+        }
+        header++;
+    }
+    if (len > MAX_RECORD_SIZE) {
+        return -1;
+    }
+    size_t trailer = (mode == FRAME_NETSTRING) ? 1 : 0;
+    if (avail < header + len + trailer) {
+        return 0;
+    } else if (trailer && start[header + len] != ',') {
+        return -1;
+    }
+    record->data = (char *) start + header;
+    record->len = len;
+    reader->start += header + len + trailer;
+    return 1;
+}
+
+/* size_t frame_size(FrameMode mode, SharedLine *line, bool tagged)
+* -----------------------------------------------
+* Works out how many bytes a queued line takes up when framed
+*
+* args: mode - how records are delimited, line - the line, tagged - true if
+*     the line is sent as a request, starting with its ID and a space
+* Returns: the size of the framed line
+*/
+size_t frame_size(FrameMode mode, SharedLine *line, bool tagged) {
+    size_t len = line->len - 1;
+    if (tagged) {
+        char tag[24];
+        len += format_int(tag, (long) line->seq) + 1;
+    }
+    if (mode == FRAME_LINE) {
+        return len + 1;
+    } else if (mode == FRAME_LENGTH) {
+        return len + 4;
+    }
+    size_t digits = 1;
+    for (size_t rest = len; rest >= 10; rest /= 10) {
+        digits++;
+    }
+    return digits + len + 2;
+}
+
+/* int frame_line(FrameMode mode, SharedLine *line, bool tagged, size_t skip,
+        char *header, struct iovec *iov)
+* -----------------------------------------------
+* Lays out a queued line for writev: its header, formatted into header, the
+* line, and for a netstring the trailing comma. A length prefixed record or
+* netstring leaves out the newline. The header of a request ends with its ID
+* and a space.
+*
+* args: mode - how records are delimited, line - the line, tagged - true if
+*     the line is sent as a request, skip - how many bytes of the framed line
+*     were written already, header - at least 48 bytes for the header, iov -
+*     where up to three entries are stored
+* Returns: the number of entries stored in iov
+*/
+int frame_line(FrameMode mode, SharedLine *line, bool tagged, size_t skip,
+        char *header, struct iovec *iov) {
+    char tag[24];
+    size_t tagLen = 0;
+    if (tagged) {
+        tagLen = format_int(tag, (long) line->seq);
+        tag[tagLen++] = ' ';
+    }
+    size_t len = (mode == FRAME_LINE) ? line->len : line->len - 1;
+    size_t headerLen = 0;
+    if (mode == FRAME_LENGTH) {
+        size_t total = tagLen + len;
+        header[0] = (char) (total >> 24);
+        header[1] = (char) (total >> 16);
+        header[2] = (char) (total >> 8);
+        header[3] = (char) total;
+        headerLen = 4;
+    } else if (mode == FRAME_NETSTRING) {
+        headerLen = format_int(header, tagLen + len);
+        header[headerLen++] = ':';
+    }
+    memcpy(header + headerLen, tag, tagLen);
+    headerLen += tagLen;
+    struct iovec parts[3] = {
+        {header, headerLen},
+        {line->data, len},
+        {",", (mode == FRAME_NETSTRING) ? 1 : 0}
+    };
+    int count = 0;
+    for (int k = 0; k < 3; k++) {
+        if (skip >= parts[k].iov_len) {
+            skip -= parts[k].iov_len;
+            continue;
+        }
+        iov[count].iov_base = (char *) parts[k].iov_base + skip;
+        iov[count].iov_len = parts[k].iov_len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+/* int split_fields(char *text, char sep, char **fields, int max)
+* -----------------------------------------------
+* Splits text in place at every separator, keeping at most max fields; the
+* text after the last kept field is ignored
+*
+* args: text - the text to split, sep - the separator, fields - where the
+*     fields are stored, max - the number of entries in fields
+* Returns: the number of fields stored
+*/
+int split_fields(char *text, char sep, char **fields, int max) {
+    int count = 0;
+    while (count < max) {
+        fields[count++] = text;
+        char *next = strchr(text, sep);
+        if (next == NULL) {
+            break;
+        }
+        *next = '\0';
+        text = next + 1;
+    }
+    return count;
+}
+
+/* void begin_drain(Supervisor *sv)
+* -----------------------------------------------
+* Called at the end of the main input: closes the jobs' stdin so they see EOF
+* and gives them a grace period to deliver their remaining output
+*
+* args: sv - the supervisor state
+*/
+void begin_drain(Supervisor *sv) {
+    sv->draining = true;
+    sv->drainDeadline = now_ms() + DRAIN_TIMEOUT_MS;
+    if (sv->stdinPollable) {
+        epoll_ctl(sv->epollFd, EPOLL_CTL_DEL, sv->inputFd, NULL);
+    }
+    close_links(sv);
+    JobTable *jobs = &sv->jobs;
+    for (int j = 1; j <= jobs->count; j++) {
+        // Jobs with lines still queued, for them or their group, are closed
+        // once those have been written
+        if (jobs->inFds[j] >= 0 && jobs->props[j].inQueue.count == 0
+                && !group_pending(sv, j)) {
+            close(jobs->inFds[j]);
+            jobs->inFds[j] = -1;
+        }
+    }
+}
+
+/* bool drain_finished(Supervisor *sv)
+* -----------------------------------------------
+* Checks whether there is no more output left to collect after the end of the
+* main input
+*
+* args: sv - the supervisor state
+* Returns: true if every job's output pipe has closed or the grace period is
+*     over
+*/
+bool drain_finished(Supervisor *sv) {
+    if (now_ms() >= sv->drainDeadline) {
+        return true;
+    }
+    for (int j = 1; j <= sv->jobs.count; j++) {
+        if (sv->jobs.outFds[j] >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* void run_event_loop(Supervisor *sv)
+* -----------------------------------------------
+* Waits on stdin, every job's stdout pipe and child exits at once and reacts
+* to whichever is ready, until the input is exhausted or no worker is left
+*
+* args: sv - the supervisor state
+* Errors: exits with code 0 when done, code 4 if waiting for events fails
+*/
+void run_event_loop(Supervisor *sv) {
+    struct epoll_event events[MAX_EVENTS];
+    check_viable_workers(sv);
+    while (true) {
+        int timeout = next_timeout(sv);
+        if (sv->draining) {
+            if (drain_finished(sv)) {
+                break;
+            }
+            // The deadline may have passed since drain_finished looked, and
+            // a negative timeout would wait for ever
+            long long remaining = sv->drainDeadline - now_ms();
+            timeout = (remaining > 0) ? (int) remaining : 0;
+        } else if (((!sv->stdinPollable || sv->inputPending)
+                && sv->inputWatched) || sv->failedCount > 0) {
+            timeout = 0;
+        }
+        if (sv->collectPending) {
+            timeout = 0;
+        }
+        // Output is flushed before waiting, and at least every
+        // FLUSH_INTERVAL_MS while there is always more to do
+        long long now = now_ms();
+        if (timeout != 0 || now - sv->flushedAt >= FLUSH_INTERVAL_MS) {
+            fflush(stdout);
+            sv->flushedAt = now;
+        }
+        int ready = epoll_wait(sv->epollFd, events, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(4);
+        }
+        bool inputReady = !sv->stdinPollable && sv->inputWatched;
+        for (int e = 0; e < ready; e++) {
+            uint64_t tag = events[e].data.u64;
+            if (EVENT_KIND(tag) == EV_CHILD) {
+                handle_signals(sv);
+            } else if (EVENT_KIND(tag) == EV_JOB_OUT) {
+                read_job_output(sv, EVENT_ID(tag));
+            } else if (EVENT_KIND(tag) == EV_JOB_IN) {
+                flush_job_queue(sv, EVENT_ID(tag));
+            } else if (EVENT_KIND(tag) == EV_STDIN) {
+                inputReady = true;
+            } else if (EVENT_KIND(tag) == EV_RELOAD) {
+                char requests[64];
+                while (read(reloadPipe[READ_END], requests,
+                        sizeof(requests)) > 0) {
+                }
+                reload_jobfile(sv);
+                check_viable_workers(sv);
+            } else if (EVENT_KIND(tag) == EV_CONTROL) {
+                accept_control_clients(sv);
+            } else if (EVENT_KIND(tag) == EV_CONTROL_CLIENT) {
+                handle_control_client(sv, EVENT_ID(tag), events[e].events);
+            } else if (EVENT_KIND(tag) == EV_COLLECTOR) {
+                collect_output(sv, EVENT_ID(tag));
+            }
+        }
+        if (sv->collectPending) {
+            sv->collectPending = false;
+            for (int c = 0; c < sv->collectorCount; c++) {
+                collect_output(sv, c);
+            }
+        }
+        if (sv->failedCount > 0 && !sv->draining) {
+            reap_failed_spawns(sv);
+            check_viable_workers(sv);
+        }
+        if (sv->timers.count > 0 && !sv->draining) {
+            run_due_timers(sv);
+        }
+        // Input is handled last so that output and exits reported in the
+        // same wakeup are dealt with first
+        if ((inputReady || sv->inputPending) && sv->inputWatched) {
+            if (sv->args.opts.spliceFanout) {
+                splice_input(sv);
+            } else {
+                read_input(sv, inputReady);
+            }
+        }
+        update_input_interest(sv);
+    }
+    release_all_requests(sv);
+    close_control_socket(sv);
+    jobtable_free(&sv->jobs);
+    arena_free(&sv->arena);
+    exit(0);
+}
+
+/* void setup_control_socket(Supervisor *sv)
+* -----------------------------------------------
+* Listens for control connections on the Unix domain socket given with
+* -o control=PATH. A socket left behind by an earlier run is replaced, but
+* no other kind of file is.
+*
+* args: sv - the supervisor state
+* Errors: exits with code 4 if the socket cannot be set up
+*/
+void setup_control_socket(Supervisor *sv) {
+    const char *path = sv->args.opts.controlPath;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: control socket path \"%s\" is too long\n",
+                path);
+        exit(4);
+    }
+    strcpy(addr.sun_path, path);
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    sv->controlFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+            | SOCK_CLOEXEC, 0);
+    if (sv->controlFd == -1 || bind(sv->controlFd,
+            (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(sv->controlFd, MAX_CONTROL_CLIENTS) == -1) {
+        perror("control socket");
+        exit(4);
+    }
+    sv->clients = malloc(sizeof(ControlClient) * MAX_CONTROL_CLIENTS);
+    for (int c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+        memset(&sv->clients[c], 0, sizeof(ControlClient));
+        sv->clients[c].fd = -1;
+    }
+    epoll_watch(sv->epollFd, sv->controlFd, EV_CONTROL, 0);
+}
+
+/* void close_control_socket(Supervisor *sv)
+* -----------------------------------------------
+* Closes the control socket and its connections and removes the socket file,
+* if there is a control socket
+*
+* args: sv - the supervisor state
+*/
+void close_control_socket(Supervisor *sv) {
+    if (sv->controlFd < 0) {
+        return;
+    }
+    for (int c = 0; c < MAX_CONTROL_CLIENTS; c++) {
+        if (sv->clients[c].fd >= 0) {
+            close_control_client(sv, c);
+        }
+    }
+    close(sv->controlFd);
+    sv->controlFd = -1;
+    unlink(sv->args.opts.controlPath);
+    free(sv->clients);
+    sv->clients = NULL;
+}
+
+/* void accept_control_clients(Supervisor *sv)
+* -----------------------------------------------
+* Accepts every pending control connection; a connection arriving while all
+* MAX_CONTROL_CLIENTS slots are taken is closed straight away
+*
+* args: sv - the supervisor state
+*/
+void accept_control_clients(Supervisor *sv) {
+    int fd;
+    while ((fd = accept4(sv->controlFd, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int c = 0;
+        while (c < MAX_CONTROL_CLIENTS && sv->clients[c].fd >= 0) {
+            c++;
+        }
+        if (c == MAX_CONTROL_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        ControlClient *client = &sv->clients[c];
+        client->fd = fd;
+        client->closing = false;
+        reader_init(&client->in, 0);
+        epoll_watch(sv->epollFd, fd, EV_CONTROL_CLIENT, c);
+    }
+}
+
+/* void handle_control_client(Supervisor *sv, int c, uint32_t events)
+* -----------------------------------------------
+* Writes pending responses to a control connection and reads and answers its
+* requests, whichever it is ready for. The socket is read from at most once
+* per call, so a chatty client cannot hold up the data plane.
+*
+* args: sv - the supervisor state, c - the client slot, events - the epoll
+*     events reported for the connection
+*/
+void handle_control_client(Supervisor *sv, int c, uint32_t events) {
+    ControlClient *client = &sv->clients[c];
+    if (client->fd < 0) {
+        // Closed earlier in the same wakeup
+        return;
+    }
+    if (events & EPOLLOUT) {
+        flush_control_client(sv, c);
+        if (client->fd < 0) {
+            return;
+        }
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !client->closing) {
+        ssize_t got = reader_fill(&client->in, client->fd);
+        if (got == 0 || (got == -1 && errno != EAGAIN)) {
+            client->closing = true;
+        }
+    }
+    serve_control_requests(sv, c);
+}
+
+/* void serve_control_requests(Supervisor *sv, int c)
+* -----------------------------------------------
+* Answers the complete requests buffered for a control connection, until its
+* pending responses reach CONTROL_OUTPUT_MAX; the rest are answered once the
+* client has read enough. Empty lines are ignored.
+*
+* args: sv - the supervisor state, c - the client slot
+*/
+void serve_control_requests(Supervisor *sv, int c) {
+    ControlClient *client = &sv->clients[c];
+    LineView line;
+    while (client->outLen - client->outOff <= CONTROL_OUTPUT_MAX
+            && reader_next(&client->in, &line, client->closing)) {
+        if (line.len == 0) {
+            continue;
+        }
+        char *response;
+        size_t len;
+        FILE *out = open_memstream(&response, &len);
+        run_control_request(sv, line.data, out);
+        fputc('\n', out);
+        fclose(out);
+        control_send(sv, c, response, len);
+        free(response);
+        if (client->fd < 0) {
+            return;
+        }
+    }
+    LineReader *in = &client->in;
+    size_t buffered = in->end - in->start;
+    if (buffered > CONTROL_LINE_MAX
+            && memchr(in->data + in->start, '\n', buffered) == NULL) {
+        // Too long to be a request: give up on the client
+        close_control_client(sv, c);
+    } else if (client->closing && buffered == 0
+            && client->outOff == client->outLen) {
+        close_control_client(sv, c);
+    } else {
+        set_control_interest(sv, c);
+    }
+}
+
+/* void run_control_request(Supervisor *sv, char *request, FILE *out)
+* -----------------------------------------------
+* Executes one control request and writes its response, a JSON object with
+* "ok" set to true on success or false along with an "error" message:
+*   stats [JOB]        the metrics of the supervisor or of one job
+*   signal JOB SIGNUM  sends a signal to a running job
+*   restart JOB        terminates a job and starts it again at once, or
+*                      starts a job that has ended, even if it was parked
+*   pause [JOB]        stops reading the main input, or stops a job's process
+*   resume [JOB]       undoes pause
+*   scale GROUP N      starts or stops members of a group until N are
+*                      active
+*
+* args: sv - the supervisor state, request - the request line (split in
+*     place), out - where the response is written
+*/
+void run_control_request(Supervisor *sv, char *request, FILE *out) {
+    char *args[4] = {NULL, NULL, NULL, NULL};
+    int count = split_fields(request, ' ', args, 4);
+    const char *command = args[0];
+    int id;
+    if (strcmp(command, "stats") == 0 && count <= 2) {
+        if (count == 1) {
+            fputs("{\"ok\":true,\"stats\":", out);
+            write_metrics_json(sv, out);
+            fputc('}', out);
+        } else if (parse_control_job(sv, args[1], &id, out)) {
+            fputs("{\"ok\":true,\"job\":", out);
+            write_job_metrics(sv, out, id, now_ms());
+            fputc('}', out);
+        }
+    } else if (strcmp(command, "signal") == 0 && count == 3) {
+        long signum;
+        if (!parse_control_job(sv, args[1], &id, out)) {
+            return;
+        } else if (!parse_number(args[2], 1, &signum) || signum > 31) {
+            control_error(out, "invalid signal");
+        } else if (sv->jobs.runs[id] == 0
+                || (sv->jobs.states[id] & JOB_ENDED)) {
+            control_error(out, "job is not running");
+        } else if (kill(sv->jobs.pids[id], signum) == -1) {
+            control_error(out, strerror(errno));
+        } else {
+            fputs("{\"ok\":true}", out);
+        }
+    } else if (strcmp(command, "restart") == 0 && count == 2) {
+        if (parse_control_job(sv, args[1], &id, out)) {
+            control_restart(sv, id, out);
+        }
+    } else if ((strcmp(command, "pause") == 0
+            || strcmp(command, "resume") == 0) && count <= 2) {
+        control_pause(sv, args[1], command[0] == 'p', out);
+    } else if (strcmp(command, "scale") == 0 && count == 3) {
+        control_scale(sv, args[1], args[2], out);
+    } else if (strcmp(command, "stats") == 0 || !strcmp(command, "signal")
+            || !strcmp(command, "restart") || !strcmp(command, "pause")
+            || !strcmp(command, "resume") || !strcmp(command, "scale")) {
+        control_error(out, "wrong number of arguments");
+    } else {
+        control_error(out, "unknown command");
+    }
+}
+
+/* void control_error(FILE *out, const char *message)
+* -----------------------------------------------
+* Writes the response to a control request that failed
+*
+* args: out - where the response is written, message - what went wrong
+*/
+void control_error(FILE *out, const char *message) {
+    fputs("{\"ok\":false,\"error\":", out);
+    write_json_string(out, message);
+    fputc('}', out);
+}
+
+/* bool parse_control_job(Supervisor *sv, const char *text, int *id,
+        FILE *out)
+* -----------------------------------------------
+* Parses the job ID argument of a control request
+*
+* args: sv - the supervisor state, text - the argument, id - where the job ID
+*     is stored, out - where the error response is written if it is invalid
+* Returns: true if the argument names a registered job
+*/
+bool parse_control_job(Supervisor *sv, const char *text, int *id,
+        FILE *out) {
+    long number;
+    if (!parse_number(text, 1, &number) || number > sv->jobs.count) {
+        control_error(out, "invalid job");
+        return false;
+    }
+    *id = number;
+    return true;
+}
+
+/* void control_restart(Supervisor *sv, int i, FILE *out)
+* -----------------------------------------------
+* Restarts a job on request. A running job is sent SIGTERM and started again
+* as soon as it exits, without backoff; a job that has ended, is waiting for
+* a delayed restart or was parked is started at once. Either way its crash
+* streak is cleared.
+*
+* args: sv - the supervisor state, i - the job ID, out - where the response
+*     is written
+*/
+void control_restart(Supervisor *sv, int i, FILE *out) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    bool running = jobs->runs[i] > 0 && !(jobs->states[i] & JOB_ENDED);
+    if (jobs->states[i] & JOB_REMOVED) {
+        control_error(out, "job was removed");
+        return;
+    } else if (job->jobInput == -1 || job->jobOutput == -1) {
+        control_error(out, "job has an invalid input or output file");
+        return;
+    } else if (jobs->states[i] & JOB_STANDBY) {
+        control_error(out, "job is on standby");
+        return;
+    } else if (sv->draining) {
+        control_error(out, "input is exhausted");
+        return;
+    }
+    if (running) {
+        if (job->stopAt != 0 || job->replacing) {
+            control_error(out, "job is stopping");
+            return;
+        }
+        job->restartRequested = true;
+        kill(jobs->pids[i], SIGTERM);
+        if (jobs->states[i] & JOB_PAUSED) {
+            kill(jobs->pids[i], SIGCONT);
+            jobs->states[i] &= ~JOB_PAUSED;
+        }
+    } else {
+        if (job->restartAt != 0) {
+            job->restartAt = 0;
+            sv->pendingRestarts--;
+        }
+        job->crashStreak = 0;
+        jobs->states[i] |= JOB_RUNNABLE;
+        restart_job(sv, i);
+    }
+    fputs("{\"ok\":true}", out);
+}
+
+/* void control_scale(Supervisor *sv, const char *name, const char *size,
+        FILE *out)
+* -----------------------------------------------
+* Resizes a dispatch group on request. A group with a replica range is
+* resized to its load again later on.
+*
+* args: sv - the supervisor state, name - the group name, size - the number
+*     of members to keep active, out - where the response is written
+*/
+void control_scale(Supervisor *sv, const char *name, const char *size,
+        FILE *out) {
+    int g = 0;
+    while (g < sv->groupCount && (sv->groups[g].name == NULL
+            || strcmp(sv->groups[g].name, name) != 0)) {
+        g++;
+    }
+    long wanted;
+    if (g == sv->groupCount || sv->groups[g].memberCount == 0) {
+        control_error(out, "no such group");
+    } else if (!parse_number(size, 1, &wanted)
+            || wanted > sv->groups[g].memberCount) {
+        control_error(out, "invalid group size");
+    } else if (sv->draining) {
+        control_error(out, "input is exhausted");
+    } else {
+        fprintf(out, "{\"ok\":true,\"active\":%d}",
+                scale_group(sv, g, wanted));
+    }
+}
+
+/* void control_pause(Supervisor *sv, const char *job, bool pause, FILE *out)
+* -----------------------------------------------
+* Pauses or resumes the main input, or a job's process with SIGSTOP and
+* SIGCONT. A paused job is skipped by its dispatch group; lines broadcast to
+* it queue up under the slow consumer policy.
+*
+* args: sv - the supervisor state, job - the job ID argument, NULL for the
+*     main input, pause - true to pause and false to resume, out - where the
+*     response is written
+*/
+void control_pause(Supervisor *sv, const char *job, bool pause, FILE *out) {
+    int i;
+    if (job == NULL) {
+        sv->inputPaused = pause;
+        fputs("{\"ok\":true}", out);
+        return;
+    } else if (!parse_control_job(sv, job, &i, out)) {
+        return;
+    }
+    JobTable *jobs = &sv->jobs;
+    if (jobs->runs[i] == 0 || (jobs->states[i] & JOB_ENDED)) {
+        control_error(out, "job is not running");
+        return;
+    } else if (jobs->props[i].stopAt != 0 || jobs->props[i].replacing
+            || jobs->props[i].restartRequested) {
+        control_error(out, "job is stopping");
+        return;
+    }
+    bool paused = jobs->states[i] & JOB_PAUSED;
+    if (pause != paused) {
+        kill(jobs->pids[i], pause ? SIGSTOP : SIGCONT);
+        jobs->states[i] ^= JOB_PAUSED;
+    }
+    if (paused && !pause) {
+        // Time spent paused does not count against the job's watchdog
+        JobProps *props = &jobs->props[i];
+        props->lastOutputAt = now_ms();
+        if (props->metrics.awaitingSince != 0) {
+            props->metrics.awaitingSince = now_us();
+        }
+        arm_watchdog(sv, i);
+        if (props->group >= 0 && sv->groups[props->group].shared) {
+            feed_group(sv, props->group);
+        }
+    }
+    fputs("{\"ok\":true}", out);
+}
+
+/* void control_send(Supervisor *sv, int c, const char *data, size_t len)
+* -----------------------------------------------
+* Queues a response for a control connection and writes as much of it as the
+* socket takes without blocking
+*
+* args: sv - the supervisor state, c - the client slot, data - the response,
+*     len - its length
+*/
+void control_send(Supervisor *sv, int c, const char *data, size_t len) {
+    ControlClient *client = &sv->clients[c];
+    if (client->outOff > 0) {
+        memmove(client->out, client->out + client->outOff,
+                client->outLen - client->outOff);
+        client->outLen -= client->outOff;
+        client->outOff = 0;
+    }
+    if (client->outLen + len > client->outCap) {
+        client->outCap = client->outLen + len + READ_CHUNK;
+        client->out = realloc(client->out, client->outCap);
+    }
+    memcpy(client->out + client->outLen, data, len);
+    client->outLen += len;
+    flush_control_client(sv, c);
+}
+
+/* void flush_control_client(Supervisor *sv, int c)
+* -----------------------------------------------
+* Writes pending responses to a control connection until the socket would
+* block; the connection is closed if the client has gone away
+*
+* args: sv - the supervisor state, c - the client slot
+*/
+void flush_control_client(Supervisor *sv, int c) {
+    ControlClient *client = &sv->clients[c];
+    while (client->outOff < client->outLen) {
+        ssize_t sent = send(client->fd, client->out + client->outOff,
+                client->outLen - client->outOff, MSG_NOSIGNAL);
+        if (sent > 0) {
+            client->outOff += sent;
+        } else if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent == -1 && errno == EAGAIN) {
+            return;
+        } else {
+            close_control_client(sv, c);
+            return;
+        }
+    }
+}
+
+/* void set_control_interest(Supervisor *sv, int c)
+* -----------------------------------------------
+* Waits for a control connection to be readable unless it is closing or has
+* too many responses pending, and for it to be writable while responses are
+* pending
+*
+* args: sv - the supervisor state, c - the client slot
+*/
+void set_control_interest(Supervisor *sv, int c) {
+    ControlClient *client = &sv->clients[c];
+    size_t pending = client->outLen - client->outOff;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (!client->closing && pending <= CONTROL_OUTPUT_MAX) {
+        ev.events |= EPOLLIN;
+    }
+    if (pending > 0) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u64 = EVENT_TAG(EV_CONTROL_CLIENT, c);
+    epoll_ctl(sv->epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/* void close_control_client(Supervisor *sv, int c)
+* -----------------------------------------------
+* Closes a control connection and frees its slot
+*
+* args: sv - the supervisor state, c - the client slot
+*/
+void close_control_client(Supervisor *sv, int c) {
+    ControlClient *client = &sv->clients[c];
+    close(client->fd);
+    client->fd = -1;
+    free(client->in.data);
+    reader_init(&client->in, 0);
+    free(client->out);
+    client->out = NULL;
+    client->outLen = client->outOff = client->outCap = 0;
+}
+
+/* pid_t spawn_child(JobProps *job, int *inFd, int *outFd)
+* -----------------------------------------------
+* Starts a process for a job with posix_spawn, which avoids copying the
+* supervisor's address space, using the argument vector prepared when the job
+* was registered. The job's stdin and stdout are connected to new pipes or
+* to its input and output files.
+*
+* args: job - the job to start, inFd, outFd - where jobthing's non-blocking
+*     ends of the job's stdin and stdout pipes are stored (-1 if the job uses
+*     a file instead)
+* Returns: the pid of the spawned child, or -1 if the command could not be
+*     executed
+* Errors: exits with error code 0 if no process can be created
+*/
+pid_t spawn_child(JobProps *job, int *inFd, int *outFd) {
+    int pipeIn[2] = {-1, -1};
+    int pipeOut[2] = {-1, -1};
+    if (job->jobInput == -2) {
+        // Create Pipe to redirect stdin from jobthing to job
+        if (pipe2(pipeIn, O_CLOEXEC) == -1) {
+            perror("in");
+        }
+    }
+    if (job->jobOutput == -2) {
+        // Create Pipe to redirect stdout from job to jobthing
+        if (pipe2(pipeOut, O_CLOEXEC) == -1) {
+            perror("out");
+        }
+    }
+    // Every other descriptor of the supervisor is close-on-exec, so only
+    // stdin and stdout need setting up
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, (job->jobInput == -2)
+            ? pipeIn[READ_END] : job->jobInput, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, (job->jobOutput == -2)
+            ? pipeOut[WRITE_END] : job->jobOutput, STDOUT_FILENO);
+    // The supervisor keeps SIGCHLD blocked; the job starts unblocked
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t emptyMask;
+    sigemptyset(&emptyMask);
+    posix_spawnattr_setsigmask(&attr, &emptyMask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int error = posix_spawnp(&pid, job->argv[0], &actions, &attr, job->argv,
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error == EAGAIN || error == ENOMEM) {
+        fprintf(stderr, "fork() failed!\n");
+        exit(0);
+    }
+    // The child's ends of the pipes are only needed by the child
+    if (pipeIn[READ_END] >= 0) {
+        close(pipeIn[READ_END]);
+        fcntl(pipeIn[WRITE_END], F_SETFL, O_NONBLOCK);
+    }
+    if (pipeOut[WRITE_END] >= 0) {
+        close(pipeOut[WRITE_END]);
+        fcntl(pipeOut[READ_END], F_SETFL, O_NONBLOCK);
+    }
+    *inFd = pipeIn[WRITE_END];
+    *outFd = pipeOut[READ_END];
+    return error ? -1 : pid;
+}
+
+/* int load_jobfile(Supervisor *sv, const char *path)
+* -----------------------------------------------
+* Registers every job of the jobfile
+*
+* args: sv - the supervisor state, path - the path of the jobfile
+* Returns: the number of registered jobs that cannot be run
+* Errors: exits with code 2 if the job file cannot be opened
+*/
+int load_jobfile(Supervisor *sv, const char *path) {
+    int count;
+    JobSpec *specs = parse_jobfile(sv, path, &sv->arena, &count);
+    if (specs == NULL) {
+        fprintf(stderr, "Error: Unable to read job file\n");
+        exit(2);
+    }
+    int invalidJobs = 0;
+    for (int k = 0; k < count; k++) {
+        if (!register_job(sv, &specs[k])) {
+            invalidJobs++;
+        }
+    }
+    free(specs);
+    // Only now can jobs read the output of jobs further down the jobfile
+    return invalidJobs + link_jobs(sv);
+}
+
+/* JobSpec *parse_jobfile(Supervisor *sv, const char *path, Arena *arena,
+        int *count)
+* -----------------------------------------------
+* Parses every job of the jobfile in a single pass over the file, which is
+* mapped into memory rather than read line by line. Blank lines and lines
+* starting with '#' are skipped, as is leading and trailing whitespace, and
+* invalid lines are reported with -v.
+*
+* args: sv - the supervisor state, path - the path of the jobfile, arena -
+*     where the strings of the jobs are allocated, count - where the number
+*     of jobs is stored
+* Returns: the jobs in jobfile order, or NULL if the file cannot be opened
+*/
+JobSpec *parse_jobfile(Supervisor *sv, const char *path, Arena *arena,
+        int *count) {
+    size_t size;
+    bool mapped;
+    char *text = map_jobfile(path, &size, &mapped);
+    if (text == NULL) {
+        return NULL;
+    }
+    int cap = 16;
+    JobSpec *specs = malloc(sizeof(JobSpec) * cap);
+    *count = 0;
+    const char *end = text + size;
+    const char *line = text;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *lineEnd = newline ? newline : end;
+        const char *next = newline ? newline + 1 : end;
+        while (line < lineEnd && isspace((unsigned char) *line)) {
+            line++;
+        }
+        while (lineEnd > line && isspace((unsigned char) lineEnd[-1])) {
+            lineEnd--;
+        }
+        if (line == lineEnd || *line == '#') {
+            line = next;
+            continue;
+        }
+        if (*count == cap) {
+            cap *= 2;
+            specs = realloc(specs, sizeof(JobSpec) * cap);
+        }
+        if (parse_job_spec(arena, line, lineEnd - line, &specs[*count])) {
+            specs = add_replicas(arena, specs, count, &cap);
+        } else if (sv->args.verboseFlag == true) {
+            fprintf(stderr, "Error: invalid job specification: %.*s\n",
+                    (int) (lineEnd - line), line);
+        }
+        line = next;
+    }
+    if (mapped) {
+        munmap(text, size);
+    } else {
+        free(text);
+    }
+    return specs;
+}
+
+/* JobSpec *add_replicas(Arena *arena, JobSpec *specs, int *count, int *cap)
+* -----------------------------------------------
+* Adds a newly parsed job to the list of jobs, once for each of its replicas.
+* The replicas of a job form a dispatch group, which is named after the
+* position of the first replica in the list (its job ID, unless a reload
+* moves it) if the job names no group, and dispatches to the least loaded
+* replica unless the job gives a policy.
+*
+* args: arena - where the group name is allocated, specs - the jobs, count -
+*     the number of jobs before the new one, which is stored at specs[*count],
+*     and updated, cap - the size of specs, updated if it grows
+* Returns: the list of jobs, which may have moved
+*/
+JobSpec *add_replicas(Arena *arena, JobSpec *specs, int *count, int *cap) {
+    JobOptions *opts = &specs[*count].opts;
+    if (opts->replicaMax == 0) {
+        (*count)++;
+        return specs;
+    }
+    if (opts->group == NULL) {
+        opts->group = arena_alloc(arena, 16);
+        snprintf(opts->group, 16, "%d", *count + 1);
+    }
+    if (!opts->hasDispatch) {
+        opts->dispatch = DISPATCH_LEAST;
+        opts->hasDispatch = true;
+    }
+    while (*cap < *count + opts->replicaMax + 1) {
+        *cap *= 2;
+    }
+    specs = realloc(specs, sizeof(JobSpec) * *cap);
+    for (int k = 1; k < specs[*count].opts.replicaMax; k++) {
+        specs[*count + k] = specs[*count];
+        specs[*count + k].opts.replica = k;
+    }
+    *count += specs[*count].opts.replicaMax;
+    return specs;
+}
+
+/* char *map_jobfile(const char *path, size_t *size, bool *mapped)
+* -----------------------------------------------
+* Makes the contents of the jobfile available in memory, mapping it if it is
+* a regular file and reading it otherwise (e.g. for a pipe)
+*
+* args: path - the path of the jobfile, size - where the length of the
+*     contents is stored, mapped - set to true if the contents must be
+*     released with munmap rather than free
+* Returns: the contents of the jobfile (not null terminated), or NULL if it
+*     cannot be opened
+*/
+char *map_jobfile(const char *path, size_t *size, bool *mapped) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat info;
+    *mapped = false;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        char *text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            madvise(text, info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *size = info.st_size;
+            *mapped = true;
+            return text;
+        }
+    }
+    size_t cap = READ_CHUNK;
+    char *text = malloc(cap);
+    *size = 0;
+    while (true) {
+        if (*size == cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+        ssize_t got = read(fd, text + *size, cap - *size);
+        if (got > 0) {
+            *size += got;
+        } else if (got == 0 || errno != EINTR) {
+            // A jobfile that cannot be read (e.g. a directory) has no jobs
+            break;
+        }
+    }
+    close(fd);
+    return text;
+}
+
+/* bool parse_job_spec(Arena *arena, const char *text, size_t len,
+        JobSpec *spec)
+* -----------------------------------------------
+* Parses a trimmed, non-comment jobfile line of the form
+* restarts[,option=value...]:input:output:command
+* where input may be @N to read the stdout of job N
+*
+* args: arena - where the strings of the job are allocated, text - the line,
+*     len - the length of the line, spec - where the job is stored
+* Returns: true if the line is a valid job specification
+*/
+bool parse_job_spec(Arena *arena, const char *text, size_t len,
+        JobSpec *spec) {
+    int colonCount = 0;
+    for (const char *colon = text;
+            (colon = memchr(colon, ':', text + len - colon)) != NULL;
+            colon++) {
+        colonCount++;
+    }
+    if (colonCount != 3) {
+        return false;
+    }
+    // Split a copy that the fields can keep pointing into
+    char *line = arena_strndup(arena, text, len);
+    char *jobSpecs[4];
+    split_fields(line, ':', jobSpecs, 4);
+    set_default_job_options(&spec->opts);
+    char *optionList = strchr(jobSpecs[0], ',');
+    if (optionList != NULL) {
+        *optionList++ = '\0';
+    }
+    spec->restartCount = 0;
+    if (jobSpecs[0][0] != '\0') {
+        char *endptr;
+        spec->restartCount = strtol(jobSpecs[0], &endptr, 10);
+        if ((endptr == jobSpecs[0]) || (*endptr != '\0')
+                || spec->restartCount < 0) {
+            return false;
+        }
+    }
+    if (optionList != NULL && !parse_job_options(&spec->opts, optionList)) {
+        return false;
+    }
+    spec->input = jobSpecs[1];
+    spec->output = jobSpecs[2];
+    spec->cmd = jobSpecs[3];
+    long upstream;
+    if (spec->cmd[0] == ' ' || (spec->input[0] == '@'
+            && !parse_number(spec->input + 1, 1, &upstream))) {
+        return false;
+    }
+    spec->argv = split_command(arena, spec->cmd, &spec->argc);
+    return spec->argc > 0;
+}
+
+/* char **split_command(Arena *arena, const char *cmd, int *count)
+* -----------------------------------------------
+* Splits a command into arguments at spaces outside double quotes; the quotes
+* themselves are removed
+*
+* args: arena - where the argument vector is allocated, cmd - the command,
+*     count - where the number of arguments is stored
+* Returns: the NULL terminated argument vector
+*/
+char **split_command(Arena *arena, const char *cmd, int *count) {
+    size_t len = strlen(cmd);
+    // No more than one argument per two characters, plus the terminator
+    char **argv = arena_alloc(arena,
+            sizeof(char *) * (len / 2 + 2) + len + 1);
+    char *out = (char *) (argv + len / 2 + 2);
+    const char *in = cmd;
+    *count = 0;
+    while (*in) {
+        while (*in == ' ') {
+            in++;
+        }
+        if (*in == '\0') {
+            break;
+        }
+        argv[(*count)++] = out;
+        bool quoted = false;
+        while (*in && (quoted || *in != ' ')) {
+            if (*in == '"') {
+                quoted = !quoted;
+            } else {
+                *out++ = *in;
+            }
+            in++;
+        }
+        *out++ = '\0';
+    }
+    argv[*count] = NULL;
+    return argv;
+}
+
+/* bool register_job(Supervisor *sv, JobSpec *spec)
+* -----------------------------------------------
+* Adds a parsed job to the job table and opens its input and output files
+*
+* args: sv - the supervisor state, spec - the job
+* Returns: false if the job is not to be started: a file cannot be opened, in
+*     which case the job is registered but not runnable, or it is a replica
+*     put on standby
+*/
+bool register_job(Supervisor *sv, JobSpec *spec) {
+    int id = jobtable_add(&sv->jobs);
+    sv->jobs.props[id].jobID = id;
+    sv->jobs.props[id].group = -1;
+    sv->jobs.props[id].jobInput = sv->jobs.props[id].jobOutput = -2;
+    sv->jobs.props[id].linkFd = -1;
+    sv->jobs.props[id].metrics.lastExit = -1;
+    sv->jobs.props[id].metrics.lastSignal = -1;
+    apply_job_spec(sv, id, spec);
+    if (sv->args.verboseFlag) {
+        printf("Registering worker %d: ", id);
+        for (int i = 0; i < spec->argc; i++) {
+            printf((i < spec->argc - 1) ? "%s " : "%s", spec->argv[i]);
+        }
+        printf("\n");
+        end_console_line(sv);
+    }
+    return prepare_job(sv, id);
+}
+
+/* void apply_job_spec(Supervisor *sv, int id, JobSpec *spec)
+* -----------------------------------------------
+* Copies the parts of a parsed job that do not affect a running process into
+* the job table
+*
+* args: sv - the supervisor state, id - the job ID, spec - the job
+*/
+void apply_job_spec(Supervisor *sv, int id, JobSpec *spec) {
+    JobProps *job = &sv->jobs.props[id];
+    job->restartCount = spec->restartCount;
+    job->infiniteRestart = (spec->restartCount == 0);
+    job->opts = spec->opts;
+    job->jobCmd = spec->cmd;
+    job->argv = spec->argv;
+    job->inputPath = spec->input;
+    job->outputPath = spec->output;
+    replay_trim(&job->replay, replay_limit(sv, id));
+    if (sv->jobs.runs[id] > 0 && !(sv->jobs.states[id] & JOB_ENDED)) {
+        // A running job picks up a new deadline or idle timeout at once
+        if (job->opts.idleMs > 0 && job->lastOutputAt == 0) {
+            job->lastOutputAt = now_ms();
+        }
+        arm_watchdog(sv, id);
+    }
+}
+
+/* bool open_job_files(Supervisor *sv, int id)
+* -----------------------------------------------
+* Opens the input and output files named for a job, closing any it had open
+* before and releasing the link pipe it read unless it still reads the same
+* job, and marks the job runnable if both could be opened
+*
+* args: sv - the supervisor state, id - the job ID
+* Returns: false if a file cannot be opened
+*/
+bool open_job_files(Supervisor *sv, int id) {
+    JobProps *job = &sv->jobs.props[id];
+    uint8_t *state = &sv->jobs.states[id];
+    long upstream = 0;
+    if (job->inputPath[0] == '@') {
+        parse_number(job->inputPath + 1, 1, &upstream);
+    }
+    // A job still reading the same job keeps its link, and whatever is
+    // buffered in it, so the job writing to it is not disturbed
+    bool keepLink = job->linkFd >= 0 && upstream == job->upstream;
+    if (!keepLink) {
+        unlink_job(sv, id);
+    }
+    if (job->jobOutput >= 0 && job->downstream > 0
+            && job->jobOutput == sv->jobs.props[job->downstream].linkFd) {
+        // The write end of a link belongs to the job reading it
+        job->jobOutput = -2;
+    }
+    for (int *fd = &job->jobInput; fd <= &job->jobOutput; fd++) {
+        if (keepLink && fd == &job->jobInput) {
+            continue;
+        } else if (*fd >= 0) {
+            close(*fd);
+        }
+        *fd = -2;
+    }
+    *state &= ~(JOB_RUNNABLE | JOB_PIPE_IN | JOB_PIPE_OUT);
+    if (job->inputPath[0] == '@') {
+        // Linked to its upstream job when it is started, if it is not yet
+    } else if (job->inputPath[0] != '\0') {
+        job->jobInput = open(job->inputPath, O_RDONLY | O_CLOEXEC);
+        if (job->jobInput == -1) {
+            fprintf(stderr, "Error: unable to open \"%s\" for reading\n",
+                    job->inputPath);
+            return false;
+        }
+    } else {
+        *state |= JOB_PIPE_IN;
+    }
+    if (job->outputPath[0] != '\0') {
+        job->jobOutput = open(job->outputPath, O_WRONLY | O_CREAT | O_TRUNC
+                | O_CLOEXEC, S_IWUSR | S_IRUSR);
+        if (job->jobOutput == -1) {
+            fprintf(stderr, "Error: unable to open \"%s\" for writing\n",
+                    job->outputPath);
+            return false;
+        }
+    } else {
+        *state |= JOB_PIPE_OUT;
+    }
+    *state |= JOB_RUNNABLE;
+    return true;
+}
 
-/* int main(int argc, char *argv[])
+/* bool prepare_job(Supervisor *sv, int id)
 * -----------------------------------------------
-* Main function for the jobthing program
+* Opens a job's input and output files and decides whether it is started: a
+* replica beyond the minimum of its job's replica range is put on standby
+* instead, until its group is scaled up
 *
-* args: int argc, char *argv[]
-* Returns: 0 on success
-* Errors: exits with various exit codes {1, 2, 3, 99} on failure
-*/ 
-int main(int argc, char *argv[]) {
-    // Signal handling
-    for (int i = 0; i < 3; i++) {
-        signals[0][i] = 0;
+* args: sv - the supervisor state, id - the job ID
+* Returns: true if the job is to be started
+*/
+bool prepare_job(Supervisor *sv, int id) {
+    JobOptions *opts = &sv->jobs.props[id].opts;
+    uint8_t *state = &sv->jobs.states[id];
+    *state &= ~JOB_STANDBY;
+    if (!open_job_files(sv, id)) {
+        return false;
     }
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sig_handler;
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGHUP, &sa, 0);
-    sigaction(SIGPIPE, &sa, 0);
-    sigaction(SIGINT, &sa, 0);
+    if (opts->replicaMax > 0 && opts->replica >= opts->replicaMin) {
+        *state &= ~JOB_RUNNABLE;
+        *state |= JOB_STANDBY;
+        return false;
+    }
+    return true;
+}
 
-    CmdArgs args = parse_command_line_args(argc, argv);
-    FILE *jobFile;
-    jobFile = open_jobfile(args.jobFile);
-    char *jobLine;
-    int jobCount = 0;
+/* int link_jobs(Supervisor *sv)
+* -----------------------------------------------
+* Links every registered job whose input is @N to job N, once the whole
+* jobfile is registered. A job that cannot be linked is reported and is not
+* runnable, as if its input file could not be opened.
+*
+* args: sv - the supervisor state
+* Returns: the number of jobs that were runnable and cannot be linked
+*/
+int link_jobs(Supervisor *sv) {
+    JobTable *jobs = &sv->jobs;
     int invalidJobs = 0;
-    int arraySize = 2;
-    pid_t *pids = malloc(sizeof(pid_t));
-    JobProps *jobList = (JobProps *) calloc(1, sizeof(JobProps));
-
-    while ((jobLine = read_line(jobFile))) {
-        jobLine = trim_whitespace(jobLine);
-        if ((jobLine[0] == '#') || (strlen(jobLine) == 0)) {
-            free(jobLine);
+    for (int i = 1; i <= jobs->count; i++) {
+        JobProps *job = &jobs->props[i];
+        if (job->inputPath[0] != '@' || job->linkFd >= 0
+                || !(jobs->states[i] & (JOB_RUNNABLE | JOB_STANDBY))) {
             continue;
         }
-        int colonCount = count_colons(jobLine);
-        if (colonCount != 3) {
-            if (args.verboseFlag == true) {
-                fprintf(stderr, "Error: invalid job specification: %s\n",
-                        jobLine);
+        if (!link_job(sv, i)) {
+            job->jobInput = -1;
+            if (jobs->states[i] & JOB_RUNNABLE) {
+                invalidJobs++;
             }
-            free(jobLine);
-            continue;
+            jobs->states[i] &= ~(JOB_RUNNABLE | JOB_STANDBY);
         }
-        char *copyJobLine = strdup(jobLine);
-        char **jobSpecs = split_line(jobLine, ':');
-        int numRestarts;
-        if (jobSpecs[0] != NULL && (strcmp(jobSpecs[0], "") != 0)) {
-            char *endptr;
-            numRestarts = strtol(jobSpecs[0], &endptr, 10);
-            if ((endptr == jobSpecs[0]) || (*endptr != '\0') 
-                    || numRestarts < 0) {
-                if (args.verboseFlag == true) {
-                    fprintf(stderr, "Error: invalid job specification: %s\n",
-                            copyJobLine);
-                }
-                free(jobLine);
-                free(copyJobLine);
-                free(jobSpecs);
-                continue;
-            }
-        } else if ((strcmp(jobSpecs[0], "") != 0)) {
-            numRestarts = 0;
-        }
-        char *jobInput = strdup(jobSpecs[1]);
-        char *jobOutput = strdup(jobSpecs[2]);
-        if (jobSpecs[3][0] != ' ') {
-            int count;
-            char *jobSpecsCopy = strdup(jobSpecs[3]);
-            char **cmdArgs = split_space_not_quote(jobSpecs[3], &count);
-            if (count == 0) {
-                if (args.verboseFlag == true) {
-                    fprintf(stderr, "Error: invalid job specification: %s\n",
-                            copyJobLine);
-                }
-                free(jobLine);
-                free(jobSpecsCopy);
-                free(cmdArgs);
-                free(jobInput);
-                free(jobOutput);
-                free(copyJobLine);
-                free(jobSpecs);
-                continue;
-            }
-            jobCount++;
-            if (jobCount == arraySize - 1) {
-                arraySize = arraySize * 2;
-                jobList =
-                        (JobProps *) realloc(jobList, 
-                        sizeof(JobProps) * arraySize);
-                pids = (pid_t *) realloc(pids, sizeof(pids) * arraySize);
-            }
-            jobList[jobCount].jobID = jobCount;
-            jobList[jobCount].runnable = true;
-            jobList[jobCount].ended = false;
-            jobList[jobCount].restartCount = numRestarts;
-            strcpy(jobList[jobCount].jobCmd, jobSpecsCopy);
-            if (args.verboseFlag) {
-                printf("Registering worker %d: ", jobCount);
-                fflush(stdout);
-                for (int i = 0; i < count; i++) {
-                    printf("%s", cmdArgs[i]);
-                    if (i < count - 1) {
-                        printf(" ");
-                    }
-                    fflush(stdout);
-                }
-                printf("\n");
-                fflush(stdout);
-            }
-            if (jobList[jobCount].restartCount == 0) {
-                jobList[jobCount].infiniteRestart = true;
-            } else {
-                jobList[jobCount].infiniteRestart = false;
-            }
-            if (strlen(jobInput) != 0) {
-                jobList[jobCount].jobInput = open(jobInput, O_RDONLY);
-                if (jobList[jobCount].jobInput == -1) {
-                    fprintf(stderr,
-                            "Error: unable to open \"%s\" for reading\n",
-                            jobInput);
-                    jobList[jobCount].runnable = false;
-                    invalidJobs++;
-                    free(jobLine); 
-                    free(jobSpecsCopy);
-                    free(cmdArgs);
-                    free(jobInput);
-                    free(jobOutput);
-                    free(copyJobLine);
-                    free(jobSpecs);
-                    continue;
-                }
-            } else {
-                jobList[jobCount].jobInput = -2;
-            }
-            if (strlen(jobOutput) != 0) {
-                jobList[jobCount].jobOutput =
-                        open(jobOutput, O_WRONLY | O_CREAT | O_TRUNC,
-                        S_IWUSR | S_IRUSR);
-                if (jobList[jobCount].jobOutput == -1) {
-                    fprintf(stderr,
-                            "Error: unable to open \"%s\" for writing\n",
-                            jobOutput);
-                    jobList[jobCount].runnable = false;
-                    invalidJobs++;
-                    free(jobLine);   
-                    free(jobSpecsCopy);
-                    free(cmdArgs);
-                    free(jobInput);
-                    free(jobOutput);
-                    free(copyJobLine);
-                    free(jobSpecs);
-                    continue;
-                }
-            } else {
-                jobList[jobCount].jobOutput = -2;
+    }
+    return invalidJobs;
+}
 
-            }
-        } else {
-            if (args.verboseFlag == true) {
-                fprintf(stderr, "Error: invalid job specification: %s\n",
-                        copyJobLine);
-            }
-            free(jobLine);
-            free(jobInput);
-            free(jobOutput);
-            free(copyJobLine);
-            free(jobSpecs);
-            continue;
-        }
+/* bool link_job(Supervisor *sv, int i)
+* -----------------------------------------------
+* Connects a job whose input is @N to the stdout of job N through a new pipe,
+* so that lines pass from one to the other without going through the
+* supervisor. Job N may have only one reader and must not have an output
+* file. If job N is running, its current process keeps writing to the
+* supervisor and only its next run writes to the link.
+*
+* args: sv - the supervisor state, i - the ID of the reading job
+* Returns: false if the job cannot read job N's output
+*/
+bool link_job(Supervisor *sv, int i) {
+    JobTable *jobs = &sv->jobs;
+    JobProps *job = &jobs->props[i];
+    long up;
+    parse_number(job->inputPath + 1, 1, &up);
+    if (up > jobs->count || up == i || (jobs->states[up] & JOB_REMOVED)
+            || jobs->props[up].outputPath[0] != '\0'
+            || (jobs->props[up].downstream > 0
+            && jobs->props[up].downstream != i)) {
+        fprintf(stderr, "Error: job %d cannot read the output of job %ld\n",
+                i, up);
+        return false;
     }
-    free(jobLine);
-    fclose(jobFile);
-
-    signals[0][0] = jobCount;
-    int viableWorkers = jobCount - invalidJobs;
-    int jobStatuses[jobCount];
-    for (int i = 1; i <= jobCount; i++) {
-        jobStatuses[i] = 0;
-        jobList[i].status = 0;
-        jobList[i].runs = 0;
-        signals[i][1] = 0;
-        jobList[i].linesto = 0;
-        signals[i][2] = 0;
-    }
-    for (int i = 1; i <= jobCount; i++) {
-        if (jobList[i].runnable == true) {
-            pids[i] =
-                    spawn_child(&i, &jobList[i].jobInput, 
-                    &jobList[i].jobOutput, jobList[i].jobCmd, 
-                    jobList[i].jobPipeIn, jobList[i].jobPipeOut);
-            jobList[i].runs++;
-            signals[i][1] = jobList[i].runs;
-            if (args.verboseFlag) {
-                printf("Spawning worker %d\n", i);
-                fflush(stdout);
-            }
-        }
-    }
-    sleep(1);
-
-    while (viableWorkers > 0) {
-        for (int i = 1; i <= jobCount; i++) {
-            jobStatuses[i] = waitpid(pids[i], &jobList[i].status, WNOHANG);
-            if ((jobList[i].runnable == true) && (jobList[i].ended == false)) {
-                if (jobStatuses[i] == 0) {
-                    jobList[i].ended = false;
-                } else if ((jobStatuses[i] != 0)
-                        && WIFEXITED(jobList[i].status)) {
-                    printf("Job %d has terminated with exit code %d\n", i,
-                            WEXITSTATUS(jobList[i].status));
-                    fflush(stdout);
-                    kill(pids[i], SIGKILL);
-                    viableWorkers--;
-                    jobList[i].ended = true;
-                } else if (((jobStatuses[i] != 0))
-                        && WIFSIGNALED(jobList[i].status)) {
-                    printf("Job %d has terminated due to signal %d\n", i,
-                            WTERMSIG(jobList[i].status));
-                    fflush(stdout);
-                    kill(pids[i], SIGKILL);
-                    viableWorkers--;
-                    jobList[i].ended = true;
-                }
-                if (jobList[i].ended) {
-                    close(jobList[i].jobPipeIn[READ_END]);
-                    close(jobList[i].jobPipeOut[WRITE_END]);
-                    close(jobList[i].jobPipeIn[WRITE_END]);
-                    close(jobList[i].jobPipeOut[READ_END]);
-                }
-                if ((jobList[i].runs < jobList[i].restartCount)
-                        || jobList[i].infiniteRestart == true) {
-                    if (jobList[i].ended == true) {
-                        pids[i] =
-                                spawn_child(&i, &jobList[i].jobInput,
-                                &jobList[i].jobOutput,
-                                jobList[i].jobCmd,
-                                jobList[i].jobPipeIn,
-                                jobList[i].jobPipeOut);
-                        viableWorkers++;
-                        jobList[i].ended = false;
-                        jobList[i].runs++;
-                        signals[i][1] = jobList[i].runs;
-                        if (args.verboseFlag) {
-                            fprintf(stderr, "Restarting worker %d\n", i);
-                        }
-                    }
-                } else if (((jobList[i].runs) > (jobList[i].restartCount))
-                        && (jobList[i].infiniteRestart == false)) {
-                    jobList[i].runnable = false;
-                    jobList[i].ended = true;
-                }
-            }
+    JobProps *writer = &jobs->props[up];
+    unlink_job(sv, i);
+    int link[2];
+    if (pipe2(link, O_CLOEXEC) == -1) {
+        perror("link");
+        return false;
+    }
+    job->jobInput = link[READ_END];
+    job->linkFd = link[WRITE_END];
+    job->upstream = up;
+    writer->downstream = i;
+    writer->jobOutput = job->linkFd;
+    jobs->states[up] &= ~JOB_PIPE_OUT;
+    return true;
+}
+
+/* void unlink_job(Supervisor *sv, int i)
+* -----------------------------------------------
+* Releases the link pipe a job reads, if any; its upstream job writes to the
+* supervisor again from its next run
+*
+* args: sv - the supervisor state, i - the ID of the reading job
+*/
+void unlink_job(Supervisor *sv, int i) {
+    JobProps *job = &sv->jobs.props[i];
+    if (job->linkFd < 0) {
+        return;
+    }
+    JobProps *writer = &sv->jobs.props[job->upstream];
+    if (writer->downstream == i) {
+        writer->downstream = 0;
+        if (writer->jobOutput == job->linkFd) {
+            writer->jobOutput = -2;
+            sv->jobs.states[job->upstream] |= JOB_PIPE_OUT;
         }
-        if (viableWorkers < 1) {
-            int flag = 0;
-            for (int j = 1; j <= jobCount; j++) {
-                if (!jobList[j].ended) {
-                    flag = 1;
-                }
-            }
-            if (flag == 0) {
-                fprintf(stderr, "No more viable workers, exiting\n");
-                fflush(stderr);
-                free(pids);
-                free(jobList);
-                exit(0);
-            }
-        }
-        char *inputLine = read_line(stdin);
-        if (inputLine == NULL) {
-            free(inputLine);
-            exit(0);
-        }
-        if (inputLine[0] == '*') {
-            sleep(1);
-            char *inputCopy = strdup(inputLine);
-            char **inputSplit = split_line(inputCopy, ' ');
-            char *command = strdup(inputSplit[0]);
-            int num = -111;
-            int signum = -111;
-            bool invalidNum = false;
-            bool invalidSigNum = false;
-            int lengthNum = -111;
-            int lengthSigNum;
-            if (inputSplit[1]) {
-                lengthNum = strlen(inputSplit[1]);
-            } else {
-                lengthNum = -111;
-            }
-            if (lengthNum != -111) {
-                char *endptr;
-                num = strtol(inputSplit[1], &endptr, 10);
-                if ((endptr == inputSplit[1]) || (*endptr != '\0')) {
-                    invalidNum = true;
-                }
-            }
-            if (inputSplit[2]) {
-                lengthSigNum = strlen(inputSplit[2]);
-                if (lengthSigNum) {
-                    char *endptr;
-                    signum = strtol(inputSplit[2], &endptr, 10);
-                    if ((endptr == inputSplit[2]) || (*endptr != '\0')) {
-                        invalidSigNum = true;
-                    }
-                }
-            }
-            if (strcmp(command, "*signal") == 0) {
-                if ((num == -111) || (signum == -111)) {
-                    printf("Error: Incorrect number of arguments\n");
-                    free(inputLine);
-                    continue;
-                } else {
-                    if ((num > jobCount) || (num < 1)
-                            || (jobList[num].ended == true)
-                            || (invalidNum)) {
-                        invalidNum = true;
-                        printf("Error: Invalid job\n");
-                        free(inputLine);
-                        continue;
-                    }
-                    if ((signum < 1) || (signum > 31)
-                            || (invalidSigNum)) {
-                        invalidSigNum = true;
-                        printf("Error: Invalid signal\n");
-                        free(inputLine);
-                        continue;
-                    }
-                    if (!(invalidNum) && !(invalidSigNum)) {
-                        int killReturn = kill(pids[num], signum);
-                        if (killReturn == -1) {
-                            fprintf(stderr, "Kill error\n");
-                        }
-                        sleep(1);
-                        free(inputLine);
-                        continue;
-                    }
-                }
-            } else if (strcmp(command, "*sleep") == 0) {
-                if ((num == -111) || (signum != -111)) {
-                    printf("Error: Incorrect number of arguments\n");
-                    free(inputLine);
-                    continue;
-                } else {
-                    if (num < 0 || invalidNum) {
-                        printf("Error: Invalid duration\n");
-                        free(inputLine);
-                        continue;
-                    } else {
-                        usleep(num * 1000);
-                        sleep(1);
-                        free(inputLine);
-                        continue;
-                    }
-                }
-            } else {
-                printf("Error: Bad command '%s'\n", command);
-                free(inputLine);
-                continue;
-            }
-        } else {
-            for (int j = 1; j <= jobCount; j++) {
-                if (!jobList[j].ended) {
-                    close(jobList[j].jobPipeIn[READ_END]);
-                    close(jobList[j].jobPipeOut[WRITE_END]);
-                    write(jobList[j].jobPipeIn[WRITE_END], inputLine,
-                          strlen(inputLine));
-                    write(jobList[j].jobPipeIn[WRITE_END], "\n", strlen("\n"));
-                    if (jobList[j].jobInput == -2) {
-                        printf("%d<-'%s'\n", j, inputLine);
-                        fflush(stdout);
-                        jobList[j].linesto++;
-                        signals[j][2] = jobList[j].linesto;
-                    } else {
-                        jobList[j].linesto = 0;
-                        signals[j][2] = jobList[j].linesto;
-                    }
-                }
+    }
+    close(job->linkFd);
+    close(job->jobInput);
+    job->linkFd = -1;
+    job->jobInput = -2;
+    job->upstream = 0;
+}
+
+/* void close_links(Supervisor *sv)
+* -----------------------------------------------
+* Closes the supervisor's ends of every link pipe at the end of the main
+* input, so that a linked job sees EOF once the job writing to it exits, and
+* a job whose reader is gone gets EPIPE rather than blocking
+*
+* args: sv - the supervisor state
+*/
+void close_links(Supervisor *sv) {
+    for (int i = 1; i <= sv->jobs.count; i++) {
+        JobProps *job = &sv->jobs.props[i];
+        if (job->linkFd >= 0) {
+            JobProps *writer = &sv->jobs.props[job->upstream];
+            if (writer->jobOutput == job->linkFd) {
+                writer->jobOutput = -1;
             }
+            close(job->linkFd);
+            close(job->jobInput);
+            job->linkFd = job->jobInput = -1;
         }
+    }
+}
 
-        sleep(1);
-        for (int j = 1; j <= jobCount; j++) {
-            if ((jobList[j].runnable == true) && (!jobList[j].ended)
-                    && (jobList[j].jobOutput == -2)) {
-                FILE *output = fdopen(jobList[j].jobPipeOut[READ_END], "r");
-                char *outputLine = read_line(output);
-                if (!(outputLine)) {
-                    if (args.verboseFlag) {
-                        fprintf(stderr, "Received EOF from job %d\n", j);
-                    }
-                } else if (jobList[j].jobOutput == -2) {
-                    printf("%d->'%s'\n", j, outputLine);
-                    fflush(stdout);
-                } else {
-                    free(outputLine);
-                    continue;
+/* void reload_jobfile(Supervisor *sv)
+* -----------------------------------------------
+* Parses the jobfile again and brings the running jobs in line with it,
+* touching only what changed. A job whose command and files are unchanged
+* keeps running and only picks up its new restart count and options. The
+* remaining jobs of the old and new jobfile are paired in order: a job
+* paired with a different specification is stopped and started again with
+* the new one, an old job left over is stopped, and a new job left over is
+* started. Jobs keep their IDs; stopped jobs get their stdin closed once their
+* queue is written and are sent SIGTERM if they have not exited after
+* DRAIN_TIMEOUT_MS.
+*
+* args: sv - the supervisor state
+*/
+void reload_jobfile(Supervisor *sv) {
+    if (sv->draining) {
+        return;
+    }
+    Arena arena = {NULL};
+    int count;
+    JobSpec *specs = parse_jobfile(sv, sv->args.jobFile, &arena, &count);
+    if (specs == NULL) {
+        fprintf(stderr, "Error: Unable to read job file\n");
+        return;
+    }
+    if (sv->args.verboseFlag) {
+        fprintf(stderr, "Reloading jobfile\n");
+    }
+    // Jobs may change groups, so replies held back are not kept waiting
+    release_all_requests(sv);
+    JobTable *jobs = &sv->jobs;
+    int oldCount = jobs->count;
+    int *matches = calloc(count + 1, sizeof(int));
+    bool *kept = calloc(oldCount + 1, sizeof(bool));
+    match_jobs(sv, specs, count, matches);
+    for (int k = 0; k < count; k++) {
+        if (matches[k] > 0) {
+            kept[matches[k]] = true;
+            apply_job_spec(sv, matches[k], &specs[k]);
+        }
+    }
+    // Pair the rest in order
+    int old = 1;
+    for (int k = 0; k < count; k++) {
+        if (matches[k] > 0) {
+            continue;
+        }
+        while (old <= oldCount
+                && (kept[old] || (jobs->states[old] & JOB_REMOVED))) {
+            old++;
+        }
+        if (old > oldCount) {
+            if (register_job(sv, &specs[k])) {
+                start_job(sv, jobs->count);
+                sv->viableWorkers++;
+                if (sv->args.verboseFlag) {
+                    printf("Spawning worker %d\n", jobs->count);
+                    end_console_line(sv);
                 }
-                free(outputLine);
             }
+            continue;
         }
-        if (signals[0][0]) {
+        int id = old++;
+        kept[id] = true;
+        JobProps *job = &jobs->props[id];
+        bool running = jobs->runs[id] > 0 && !(jobs->states[id] & JOB_ENDED);
+        if (running) {
+            stop_job(sv, id);
+        } else if (job->restartAt != 0) {
+            job->restartAt = 0;
+            sv->pendingRestarts--;
         }
-        if (signals[0][1]) {
+        apply_job_spec(sv, id, &specs[k]);
+        if (sv->args.verboseFlag) {
+            fprintf(stderr, "Replacing worker %d\n", id);
         }
-        if (signals[0][2]) {
+        bool runnable = prepare_job(sv, id);
+        if (running) {
+            // Started with the new specification once the old process exits
+            job->replacing = runnable;
+            jobs->states[id] &= ~JOB_RUNNABLE;
+        } else if (runnable) {
+            jobs->runs[id] = 0;
+            job->crashStreak = 0;
+            restart_job(sv, id);
         }
-        free(inputLine);
-        continue;
     }
-    if (viableWorkers < 1) {
-        fprintf(stderr, "No more viable workers, exiting\n");
-        free(jobList);
-        free(pids);
-        exit(0);
+    for (int id = 1; id <= oldCount; id++) {
+        if (!kept[id] && !(jobs->states[id] & JOB_REMOVED)) {
+            if (sv->args.verboseFlag) {
+                fprintf(stderr, "Stopping worker %d\n", id);
+            }
+            stop_job(sv, id);
+            jobs->states[id] &= ~JOB_STANDBY;
+            jobs->states[id] |= JOB_REMOVED;
+            unlink_job(sv, id);
+            JobProps *job = &jobs->props[id];
+            if (job->restartAt != 0) {
+                job->restartAt = 0;
+                sv->pendingRestarts--;
+            }
+            replay_trim(&job->replay, 0);
+            // The old arena is released below
+            set_default_job_options(&job->opts);
+            job->jobCmd = job->inputPath = job->outputPath = NULL;
+            job->argv = NULL;
+        }
     }
-    return 0;
+    free(matches);
+    free(kept);
+    free(specs);
+    arena_free(&sv->arena);
+    sv->arena = arena;
+    JobGroup *oldGroups = sv->groups;
+    int oldGroupCount = sv->groupCount;
+    build_groups(sv);
+    carry_group_queues(sv, oldGroups, oldGroupCount);
 }
 
-/* void sig_handler(int signo)
+/* int match_jobs(Supervisor *sv, JobSpec *specs, int count, int *matches)
 * -----------------------------------------------
-* This function is called when a signal is received
+* Finds, for each job of a reloaded jobfile, a job that is still in the job
+* table with the same command, input and output, using a hash table so that
+* large jobfiles are matched in linear time. Each old job is matched at most
+* once.
 *
-* args: signo - the signal number 
+* args: sv - the supervisor state, specs - the reloaded jobs, count - the
+*     number of reloaded jobs, matches - where the matching job ID (or 0) of
+*     each reloaded job is stored
+* Returns: the number of jobs matched
 */
-void sig_handler(int signo) {
-    if (signo == SIGPIPE) {
+int match_jobs(Supervisor *sv, JobSpec *specs, int count, int *matches) {
+    JobTable *jobs = &sv->jobs;
+    size_t capacity = PIDMAP_MIN_CAPACITY;
+    while (capacity < (size_t) jobs->count * 2) {
+        capacity *= 2;
     }
-    if (signo == SIGHUP) {
-        signals[0][1] = 1;
-        for (int i = 1; i <= signals[0][0]; i++) {
-            fprintf(stderr, "%d:%d:%d\n", i, signals[i][1], signals[i][2]);
+    size_t mask = capacity - 1;
+    int *slots = calloc(capacity, sizeof(int));
+    for (int id = 1; id <= jobs->count; id++) {
+        JobProps *job = &jobs->props[id];
+        if (jobs->states[id] & JOB_REMOVED) {
+            continue;
         }
+        size_t slot = hash_job_identity(job->jobCmd, job->inputPath,
+                job->outputPath) & mask;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = id;
     }
-    if (signo == SIGINT) {
-        signals[0][2] = 1;
+    int matched = 0;
+    for (int k = 0; k < count; k++) {
+        JobSpec *spec = &specs[k];
+        size_t slot = hash_job_identity(spec->cmd, spec->input, spec->output)
+                & mask;
+        matches[k] = 0;
+        for (; slots[slot] != 0; slot = (slot + 1) & mask) {
+            JobProps *job = &jobs->props[slots[slot]];
+            // Matched jobs stay in their slot, negated, to keep probe chains
+            if (slots[slot] > 0 && !strcmp(job->jobCmd, spec->cmd)
+                    && !strcmp(job->inputPath, spec->input)
+                    && !strcmp(job->outputPath, spec->output)) {
+                matches[k] = slots[slot];
+                slots[slot] = -slots[slot];
+                matched++;
+                break;
+            }
+        }
     }
+    free(slots);
+    return matched;
 }
 
-/* pid_t spawn_child(int *i, int *jobInputList, int *jobOutputList,
-        char jobCmdList[50], int jobPipeIn[2], int jobPipeOut[2])
+/* uint32_t hash_job_identity(const char *cmd, const char *input,
+        const char *output)
 * -----------------------------------------------
-* This function spawns a child process
+* Hashes the parts of a job that decide whether its process can be kept
+* across a reload
 *
-* args: i - the job number, jobInputList - the input list, jobOutputList - the 
-* Returns: the pid of the spawned child
-* Errors: exits with error code 0 if fork fails, exits with error code 99 if
-     execvp fails
+* args: cmd - the command, input, output - the file names
+* Returns: the hash
 */
-pid_t spawn_child(int *i, int *jobInputList, int *jobOutputList,
-        char jobCmdList[50], int jobPipeIn[2], int jobPipeOut[2]) {
-    if (*jobInputList == -2) {
-        // Create Pipe to redirect stdout from job to jobthing
-        if (pipe(jobPipeIn) == -1) {
-            perror("in");
-        }
+uint32_t hash_job_identity(const char *cmd, const char *input,
+        const char *output) {
+    uint32_t hash = hash_bytes(cmd, strlen(cmd));
+    hash = mix_hash(hash ^ hash_bytes(input, strlen(input)));
+    return mix_hash(hash + hash_bytes(output, strlen(output)));
+}
+
+/* void stop_job(Supervisor *sv, int i)
+* -----------------------------------------------
+* Stops a job, if it is running: it receives no more lines, its stdin is closed
+* once its queue has been written, and it is sent SIGTERM if it has not
+* exited after DRAIN_TIMEOUT_MS
+*
+* args: sv - the supervisor state, i - the job ID
+*/
+void stop_job(Supervisor *sv, int i) {
+    JobTable *jobs = &sv->jobs;
+    jobs->states[i] &= ~JOB_RUNNABLE;
+    if (jobs->runs[i] == 0 || (jobs->states[i] & JOB_ENDED)) {
+        return;
     }
-    if (*jobOutputList == -2) {
-        // Create Pipe to redirect stdin from jobthing to job
-        if (pipe(jobPipeOut) == -1) {
-            perror("out");
-        }
+    if (jobs->states[i] & JOB_PAUSED) {
+        // A stopped process could neither drain its input nor exit
+        kill(jobs->pids[i], SIGCONT);
+        jobs->states[i] &= ~JOB_PAUSED;
     }
-
-    pid_t pid = fork();
-    if (pid == -1) {
-        fprintf(stderr, "fork() failed!\n");
-        exit(0);
+    if (jobs->inFds[i] >= 0 && jobs->props[i].inQueue.count == 0) {
+        close(jobs->inFds[i]);
+        jobs->inFds[i] = -1;
     }
-    if (!pid) {
-        if (*jobInputList == -2) {
-            dup2(jobPipeIn[READ_END], STDIN_FILENO);
-            close(jobPipeIn[WRITE_END]);
-            close(jobPipeIn[READ_END]);
-        } else {
-            dup2(*jobInputList, STDIN_FILENO);
-            close(*jobInputList);
+    if (jobs->props[i].stopAt == 0) {
+        sv->pendingStops++;
+    }
+    jobs->props[i].stopAt = now_ms() + DRAIN_TIMEOUT_MS;
+    schedule_timer(sv, jobs->props[i].stopAt, TIMER_STOP, i);
+}
+
+/* void carry_group_queues(Supervisor *sv, JobGroup *old, int oldCount)
+* -----------------------------------------------
+* Moves the lines queued for the shared groups that existed before a reload
+* to the rebuilt shared group of the same name, and releases the old groups.
+* The lines of a group that is gone or no longer shared are lost.
+*
+* args: sv - the supervisor state, old - the groups before the reload,
+*     oldCount - the number of old groups
+*/
+void carry_group_queues(Supervisor *sv, JobGroup *old, int oldCount) {
+    size_t limit = sv->args.opts.queueLimit;
+    for (int o = 0; o < oldCount; o++) {
+        OutQueue *queue = &old[o].queue;
+        if (queue->count == 0) {
+            continue;
         }
-        if (*jobOutputList == -2) {
-            dup2(jobPipeOut[WRITE_END], STDOUT_FILENO);
-            close(jobPipeOut[READ_END]);
-            close(jobPipeOut[WRITE_END]);
-        } else {
-            dup2(*jobOutputList, STDOUT_FILENO);
-            close(*jobOutputList);
+        if (queue->count >= limit) {
+            sv->fullQueues--;
         }
-        int cmdCount;
-        char **jobCmdArgs = split_space_not_quote(jobCmdList, &cmdCount);
-        char *jobArgs[cmdCount];
-        for (int i = 0; i < cmdCount; i++) {
-            jobArgs[i] = jobCmdArgs[i];
+        int g = 0;
+        while (g < sv->groupCount
+                && !same_group_name(old[o].name, sv->groups[g].name)) {
+            g++;
         }
-        jobArgs[cmdCount] = 0;
-        int exitStatus = execvp(jobArgs[0], jobArgs);
-        fflush(stdout);
-        if (exitStatus == -1) {
-            _exit(99);
+        if (g < sv->groupCount && sv->groups[g].shared) {
+            // The rebuilt group's queue is still empty
+            OutQueue empty = sv->groups[g].queue;
+            sv->groups[g].queue = *queue;
+            *queue = empty;
+            if (sv->groups[g].queue.count >= limit) {
+                sv->fullQueues++;
+            }
+            feed_group(sv, g);
+        } else if (sv->args.verboseFlag) {
+            fprintf(stderr, "Dropped %zu lines queued for group %s\n",
+                    queue->count, old[o].name ? old[o].name : "-");
         }
     }
-    return pid;
+    free_groups(old, oldCount);
 }
 
-/* int count_colons(char *line)
+/* void free_groups(JobGroup *groups, int count)
 * -----------------------------------------------
-* Counts the number of colons found in a line
+* Releases dispatch groups along with any lines still queued for them
 *
-* args: a line of characters
-* Returns: the count of colons 
+* args: groups - the groups, count - the number of groups
 */
-int count_colons(char *line) {
-    int count = 0;
-    for (int i = 0; line[i]; i++) {
-        if (line[i] == ':') {
-            count++;
+void free_groups(JobGroup *groups, int count) {
+    for (int g = 0; g < count; g++) {
+        while (groups[g].queue.count > 0) {
+            OutQueue *queue = &groups[g].queue;
+            shared_line_release(queue->lines[queue->head]);
+            queue->head = (queue->head + 1) % queue->cap;
+            queue->count--;
         }
+        free(groups[g].queue.lines);
+        free(groups[g].requests.items);
+        free(groups[g].name);
+        free(groups[g].members);
+        free(groups[g].ringHashes);
+        free(groups[g].ringMembers);
     }
-    return count;
+    free(groups);
 }
 
-/* char *trim_whitespace(char *str)
+/* void *arena_alloc(Arena *arena, size_t size)
 * -----------------------------------------------
-* Trims whitespace from the beginning and ending of a string
+* Allocates memory from an arena, starting a new block when the current one
+* is full
 *
-* args: string from which whitespace is to be trimmed
-* Returns: the trimmed string 
+* args: arena - the arena, size - the number of bytes needed
+* Returns: the memory, aligned to ARENA_ALIGN bytes
 */
-char *trim_whitespace(char *str) {
-// Reference: https://stackoverflow.com/questions/122616
-// /how-do-i-trim-leading-trailing-whitespace-in-a-standard-way
-    char *end;
-    // Trim leading space
-    while (isspace((unsigned char)*str)) {
-        str++;
-    }
-    if (*str == 0) {            // All spaces?
-        return str;
-    }
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) {
-        end--;
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        block->next = arena->head;
+        block->used = 0;
+        block->size = blockSize;
+        arena->head = block;
     }
-    // Write new null terminator character
-    end[1] = '\0';
-    return str;
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
 }
 
-/* FILE *open_jobfile(char *filepath)
+/* char *arena_strndup(Arena *arena, const char *text, size_t len)
 * -----------------------------------------------
-* Opens the jobfile as a FILE* object
+* Copies a string into an arena
 *
-* args: the filepath of the jobfile to be opened
-* Returns: The FILE* object jobfile
-* Errors: exits with code 2 if the job file cannot be opened
+* args: arena - the arena, text - the string, len - the length of the string
+* Returns: the null terminated copy
 */
-FILE *open_jobfile(char *filepath) {
-    FILE *jobFile;
-    jobFile = fopen(filepath, "r");
-    if (jobFile == 0) {
-        fprintf(stderr, "Error: Unable to read job file\n");
-        exit(2);
-    }
-    return jobFile;
+char *arena_strndup(Arena *arena, const char *text, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
 }
 
-/* FILE *open_inputfile(char *filepath)
+/* void arena_free(Arena *arena)
 * -----------------------------------------------
-* Opens the inputfile as a FILE* object
+* Releases everything allocated from an arena
 *
-* args: the filepath of the inputfile to be opened
-* Returns: The FILE* object inputfile
-* Errors: exits with code 3 if the input file cannot be opened
+* args: arena - the arena
 */
-FILE *open_inputfile(char *filepath) {
-    FILE *inputFile;
-    inputFile = fopen(filepath, "r");
-    if (inputFile == 0) {
-        fprintf(stderr, "Error: Unable to read input file\n");
-        exit(3);
+void arena_free(Arena *arena) {
+    while (arena->head != NULL) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    return inputFile;
 }
 
 /* CmdArgs parse_command_line_args(int argc, char *argv[])
@@ -678,74 +6467,404 @@ FILE *open_inputfile(char *filepath) {
 *
 * args: arg count and the commandline argument list
 * Returns: The parsed arguments in CmdArgs struct
-* Errors: exits with code 1 if the number of arguments is less than the minimum
-    required
+* Errors: exits with code 1 if the arguments are invalid or the jobfile is
+    missing
     exits with code 3 if the input file cannot be opened
 */
 CmdArgs parse_command_line_args(int argc, char *argv[]) {
-    if (argc < 2 || argc > 5) {
+    if (argc < 2) {
         print_std_err(1);
     }
     CmdArgs args;
     args.verboseFlag = args.inputFileFlag = args.jobFileFlag = 0;
     strcpy(args.jobFile, "");
     strcpy(args.inputFile, "");
+    set_default_options(&args.opts);
     for (int i = 1; i < argc; i++) {
-        if (args.verboseFlag && args.inputFileFlag && argc < 5) {
-            print_std_err(1);
-        }
-        if (argv[i][0] != '-' && (argv[i - 1][0] != '-'
-                || (strcmp(argv[i - 1], "-v") == 0))) {
-            if (!args.jobFileFlag) {
-                char *jobFile = parse_jobfile_path(argc, argv[i],
-                                                   args.jobFileFlag);
-                strcpy(args.jobFile, jobFile);
-                args.jobFileFlag = true;
-            } else {
+        if (strcmp(argv[i], "-v") == 0) {
+            if (args.verboseFlag) {
                 print_std_err(1);
             }
-        }
-    }
-    for (int i = 1; i < argc; i++) { 
-        if (argv[i][0] == '-') {
-            if ((strcmp(argv[i], "-i") == 0)) {
-                if (argc < 4 || args.inputFileFlag) {
-                    print_std_err(1);
-                } else if (args.verboseFlag && argc < 5) {
-                    print_std_err(1);
-                }
-                char *inputFile = parse_inputfile_path(argc, argv[i + 1],
-                                                       args.inputFileFlag);
-                if (strlen(inputFile) > 0) {
-                    strcpy(args.inputFile, inputFile);
-                    args.inputFileFlag = true;
-                }
-                if (args.inputFileFlag) {
-                    args.mainInput = open(args.inputFile, O_RDONLY);
-                    if (args.mainInput == -1) {
-                        fprintf(stderr, "Error: Unable to read input file\n");
-                        exit(3);
-                    } else {
-                        dup2(args.mainInput, STDIN_FILENO);
-                        close(args.mainInput);
-                    }
-                }
-            } else if ((strcmp(argv[i], "-v") == 0)) {
-                if (argc < 3 || args.verboseFlag) {
-                    print_std_err(1);
-                }
-                args.verboseFlag = 1;
-            } else {
+            args.verboseFlag = true;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            char *inputFile = parse_inputfile_path(argc, argv[i + 1],
+                                                   args.inputFileFlag);
+            if (strlen(inputFile) >= MAX_SIZE) {
+                print_std_err(1);
+            }
+            strcpy(args.inputFile, inputFile);
+            args.inputFileFlag = true;
+            i++;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (argv[i + 1] == NULL || !parse_option(&args.opts, argv[i + 1])) {
+                print_std_err(1);
+            }
+            i++;
+        } else if (argv[i][0] == '-') {
+            print_std_err(1);
+        } else {
+            char *jobFile = parse_jobfile_path(argc, argv[i],
+                                               args.jobFileFlag);
+            if (strlen(jobFile) >= MAX_SIZE) {
                 print_std_err(1);
             }
+            strcpy(args.jobFile, jobFile);
+            args.jobFileFlag = true;
         }
     }
     if (!args.jobFileFlag || strcmp(args.jobFile, "") == 0) {
         print_std_err(1);
     }
+    if (args.inputFileFlag) {
+        args.mainInput = open(args.inputFile, O_RDONLY);
+        if (args.mainInput == -1) {
+            fprintf(stderr, "Error: Unable to read input file\n");
+            exit(3);
+        } else {
+            dup2(args.mainInput, STDIN_FILENO);
+            close(args.mainInput);
+        }
+    }
     return args;
 }
 
+/* void set_default_options(Options *opts)
+* -----------------------------------------------
+* Fills in the value of every tuning option that is not given with -o
+*
+* args: opts - the options to initialise
+*/
+void set_default_options(Options *opts) {
+    opts->queueLimit = DEFAULT_QUEUE_LIMIT;
+    opts->slowPolicy = SLOW_BLOCK;
+    opts->spliceFanout = false;
+    opts->dispatch = DISPATCH_BROADCAST;
+    opts->keyField = 0;
+    opts->backoffMs = DEFAULT_BACKOFF_MS;
+    opts->backoffMaxMs = DEFAULT_BACKOFF_MAX_MS;
+    opts->stableMs = DEFAULT_STABLE_MS;
+    opts->crashLoop = DEFAULT_CRASHLOOP;
+    opts->metricsPath = NULL;
+    opts->controlPath = NULL;
+    opts->scaleUp = DEFAULT_SCALE_UP;
+    opts->scaleLatencyMs = 0;
+    opts->scaleIdleMs = DEFAULT_SCALE_IDLE_MS;
+    opts->threaded = false;
+    opts->collectors = -1;
+    opts->flushLines = false;
+}
+
+/* bool parse_number(const char *text, long min, long *value)
+* -----------------------------------------------
+* Parses a decimal integer that must make up the whole of the text
+*
+* args: text - the text to parse, min - the smallest accepted value,
+*     value - where the parsed number is stored
+* Returns: true if the text is a valid number no smaller than min
+*/
+bool parse_number(const char *text, long min, long *value) {
+    char *endptr;
+    errno = 0;
+    *value = strtol(text, &endptr, 10);
+    return (endptr != text) && (*endptr == '\0') && (errno == 0)
+            && (*value >= min) && (*value <= INT32_MAX);
+}
+
+/* bool parse_option(Options *opts, char *option)
+* -----------------------------------------------
+* Parses a tuning option given on the commandline as -o name=value
+*
+* args: opts - the options to update, option - the name=value text
+* Returns: true if the option is known and its value is valid
+*/
+bool parse_option(Options *opts, char *option) {
+    char *value = strchr(option, '=');
+    if (value == NULL) {
+        return false;
+    }
+    *value++ = '\0';
+    long number;
+    if (strcmp(option, "queue") == 0) {
+        if (!parse_number(value, 1, &number)) {
+            return false;
+        }
+        opts->queueLimit = number;
+    } else if (strcmp(option, "slow") == 0) {
+        if (strcmp(value, "block") == 0) {
+            opts->slowPolicy = SLOW_BLOCK;
+        } else if (strcmp(value, "drop") == 0) {
+            opts->slowPolicy = SLOW_DROP;
+        } else if (strcmp(value, "restart") == 0) {
+            opts->slowPolicy = SLOW_RESTART;
+        } else {
+            return false;
+        }
+    } else if (strcmp(option, "dispatch") == 0) {
+        if (!parse_dispatch_policy(value, &opts->dispatch)) {
+            return false;
+        }
+    } else if (strcmp(option, "key") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->keyField = number;
+    } else if (strcmp(option, "backoff") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->backoffMs = number;
+    } else if (strcmp(option, "backoff-max") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->backoffMaxMs = number;
+    } else if (strcmp(option, "stable") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->stableMs = number;
+    } else if (strcmp(option, "crashloop") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->crashLoop = number;
+    } else if (strcmp(option, "scale-up") == 0) {
+        if (!parse_number(value, 1, &number)) {
+            return false;
+        }
+        opts->scaleUp = number;
+    } else if (strcmp(option, "scale-latency") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->scaleLatencyMs = number;
+    } else if (strcmp(option, "scale-idle") == 0) {
+        if (!parse_number(value, 0, &number)) {
+            return false;
+        }
+        opts->scaleIdleMs = number;
+    } else if (strcmp(option, "metrics") == 0) {
+        if (value[0] == '\0') {
+            return false;
+        }
+        opts->metricsPath = value;
+    } else if (strcmp(option, "control") == 0) {
+        if (value[0] == '\0') {
+            return false;
+        }
+        opts->controlPath = value;
+    } else if (strcmp(option, "threads") == 0) {
+        if (strcmp(value, "on") == 0) {
+            opts->threaded = true;
+        } else if (strcmp(value, "off") == 0) {
+            opts->threaded = false;
+        } else {
+            return false;
+        }
+    } else if (strcmp(option, "collectors") == 0) {
+        if (!parse_number(value, 0, &number) || number > MAX_COLLECTORS) {
+            return false;
+        }
+        opts->collectors = number;
+    } else if (strcmp(option, "flush") == 0) {
+        if (strcmp(value, "line") == 0) {
+            opts->flushLines = true;
+        } else if (strcmp(value, "batch") == 0) {
+            opts->flushLines = false;
+        } else {
+            return false;
+        }
+    } else if (strcmp(option, "fanout") == 0) {
+        if (strcmp(value, "splice") == 0) {
+            opts->spliceFanout = true;
+        } else if (strcmp(value, "copy") == 0) {
+            opts->spliceFanout = false;
+        } else {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* bool parse_dispatch_policy(const char *text, DispatchPolicy *policy)
+* -----------------------------------------------
+* Parses the name of a dispatch policy
+*
+* args: text - the name (broadcast, rr, least or hash), policy - where the
+*     parsed policy is stored
+* Returns: true if the name is valid
+*/
+bool parse_dispatch_policy(const char *text, DispatchPolicy *policy) {
+    if (strcmp(text, "broadcast") == 0) {
+        *policy = DISPATCH_BROADCAST;
+    } else if (strcmp(text, "rr") == 0) {
+        *policy = DISPATCH_RR;
+    } else if (strcmp(text, "least") == 0) {
+        *policy = DISPATCH_LEAST;
+    } else if (strcmp(text, "hash") == 0) {
+        *policy = DISPATCH_HASH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* void set_default_job_options(JobOptions *opts)
+* -----------------------------------------------
+* Fills in the options of a job that has none given in the jobfile
+*
+* args: opts - the options to initialise
+*/
+void set_default_job_options(JobOptions *opts) {
+    opts->group = NULL;
+    opts->dispatch = DISPATCH_BROADCAST;
+    opts->keyField = 0;
+    opts->hasDispatch = opts->hasKey = false;
+    opts->deadlineMs = opts->idleMs = opts->replay = 0;
+    opts->replicaMin = opts->replicaMax = opts->replica = 0;
+    opts->frame = FRAME_LINE;
+    opts->reply = REPLY_NONE;
+    opts->window = 0;
+}
+
+/* bool parse_job_options(JobOptions *opts, char *optionList)
+* -----------------------------------------------
+* Parses the comma separated name=value options that follow the restart
+* count of a job in the jobfile
+*
+* args: opts - the options to update, optionList - the text after the first
+*     comma (modified in place, and referenced by opts)
+* Returns: true if every option is known and has a valid value
+*/
+bool parse_job_options(JobOptions *opts, char *optionList) {
+    char *option = optionList;
+    while (option != NULL) {
+        char *next = strchr(option, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        char *value = strchr(option, '=');
+        if (value == NULL || value[1] == '\0') {
+            return false;
+        }
+        *value++ = '\0';
+        long number;
+        if (strcmp(option, "group") == 0) {
+            opts->group = value;
+        } else if (strcmp(option, "dispatch") == 0) {
+            if (!parse_dispatch_policy(value, &opts->dispatch)) {
+                return false;
+            }
+            opts->hasDispatch = true;
+        } else if (strcmp(option, "key") == 0) {
+            if (!parse_number(value, 0, &number)) {
+                return false;
+            }
+            opts->keyField = number;
+            opts->hasKey = true;
+        } else if (strcmp(option, "deadline") == 0) {
+            if (!parse_number(value, 1, &number)) {
+                return false;
+            }
+            opts->deadlineMs = number;
+        } else if (strcmp(option, "idle") == 0) {
+            if (!parse_number(value, 1, &number)) {
+                return false;
+            }
+            opts->idleMs = number;
+        } else if (strcmp(option, "replay") == 0) {
+            if (!parse_number(value, 1, &number)) {
+                return false;
+            }
+            opts->replay = number;
+        } else if (strcmp(option, "replicas") == 0) {
+            if (!parse_replicas(value, opts)) {
+                return false;
+            }
+        } else if (strcmp(option, "frame") == 0) {
+            if (!parse_frame_mode(value, &opts->frame)) {
+                return false;
+            }
+        } else if (strcmp(option, "rpc") == 0) {
+            if (strcmp(value, "input") == 0) {
+                opts->reply = REPLY_INPUT;
+            } else if (strcmp(value, "completion") == 0) {
+                opts->reply = REPLY_COMPLETION;
+            } else {
+                return false;
+            }
+        } else if (strcmp(option, "window") == 0) {
+            if (!parse_number(value, 1, &number)) {
+                return false;
+            }
+            opts->window = number;
+        } else {
+            return false;
+        }
+        option = next;
+    }
+    return true;
+}
+
+/* bool parse_frame_mode(const char *text, FrameMode *mode)
+* -----------------------------------------------
+* Parses the name of a framing of job records
+*
+* args: text - the name (line, length or netstring), mode - where the parsed
+*     framing is stored
+* Returns: true if the name is valid
+*/
+bool parse_frame_mode(const char *text, FrameMode *mode) {
+    if (strcmp(text, "line") == 0) {
+        *mode = FRAME_LINE;
+    } else if (strcmp(text, "length") == 0) {
+        *mode = FRAME_LENGTH;
+    } else if (strcmp(text, "netstring") == 0) {
+        *mode = FRAME_NETSTRING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* bool parse_replicas(const char *text, JobOptions *opts)
+* -----------------------------------------------
+* Parses the number of replicas of a job, either a count or a MIN-MAX range
+*
+* args: text - the option value, opts - where the range is stored
+* Returns: true if the value is a positive count or a range of them
+*/
+bool parse_replicas(const char *text, JobOptions *opts) {
+    long low, high;
+    const char *dash = strchr(text, '-');
+    if (dash == NULL) {
+        if (!parse_number(text, 1, &high)) {
+            return false;
+        }
+        low = high;
+    } else {
+        char lowText[16];
+        size_t len = dash - text;
+        if (len >= sizeof(lowText)) {
+            return false;
+        }
+        memcpy(lowText, text, len);
+        lowText[len] = '\0';
+        if (!parse_number(lowText, 1, &low)
+                || !parse_number(dash + 1, low, &high)) {
+            return false;
+        }
+    }
+    if (high > MAX_REPLICAS) {
+        return false;
+    }
+    opts->replicaMin = low;
+    opts->replicaMax = high;
+    return true;
+}
+
 /* char *parse_inputfile_path(int argc, char *arg, bool flag)
 * -----------------------------------------------
 * Checks validity of the inputfile path argument and parses it
@@ -784,6 +6903,20 @@ char *parse_jobfile_path(int argc, char *arg, bool flag) {
     return arg;
 }
 
+/* void end_console_line(Supervisor *sv)
+* -----------------------------------------------
+* Called after printing a line, or a run of lines, to stdout: flushes it at
+* once with -o flush=line; otherwise it stays buffered with the lines that
+* follow, and the event loop flushes them together
+*
+* args: sv - the supervisor state
+*/
+void end_console_line(Supervisor *sv) {
+    if (sv->args.opts.flushLines) {
+        fflush(stdout);
+    }
+}
+
 /* void print_std_err(int value)
 * -----------------------------------------------
 * Prints out the standard error message on invalid input &
@@ -792,7 +6925,8 @@ char *parse_jobfile_path(int argc, char *arg, bool flag) {
 * args: exit code
 */
 void print_std_err(int value) {
-    fprintf(stderr, "Usage: jobthing [-v] [-i inputfile] jobfile\n");
+    fprintf(stderr, "Usage: jobthing [-v] [-i inputfile] [-o option=value ...] "
+            "jobfile\n");
     exit(value);
 }
 